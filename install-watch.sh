@@ -9,7 +9,7 @@ LAUNCH_AGENTS_DIR="$HOME/Library/LaunchAgents"
 PLIST_DEST="$LAUNCH_AGENTS_DIR/$PLIST_NAME"
 
 echo "Compiling asimov-watch..."
-clang++ -std=c++17 -framework CoreServices -O3 "$DIR/main.cpp" -o asimov-watch
+clang++ -std=c++17 -framework CoreServices -framework IOKit -O3 "$DIR/main.cpp" -o asimov-watch
 
 # Ensure bin directory exists
 if [ ! -d "$BIN_DIR" ]; then
@@ -6,334 +6,5795 @@
 //
 
 #include <CoreServices/CoreServices.h>
+#include <IOKit/ps/IOPSKeys.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <dispatch/dispatch.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <fnmatch.h>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <list>
+#include <malloc/malloc.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <notify.h>
+#include <os/log.h>
+#include <os/signpost.h>
+#include <pthread.h>
+#include <set>
+#include <spawn.h>
+#include <shared_mutex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/attr.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/vnode.h>
 #include <sys/wait.h>
 #include <sys/xattr.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+extern char **environ;
+
+// --- Rule Table ---
+
+// A sentinel file (key) marks its sibling directory (value) as a dependency
+// tree to exclude.
 struct Rule {
-  std::string key;
-  std::string value;
+  std::string_view key;
+  std::string_view value;
+};
+
+// Built-in rules. Several sentinels may share a target and vice versa.
+constexpr Rule kBuiltinRules[] = {
+    {"package.json", "node_modules"},       // Node.js
+    {"composer.json", "vendor"},            // PHP/Composer
+    {"requirements.txt", "venv"},           // Python
+    {"pyproject.toml", ".venv"},            // Python
+    {"tox.ini", ".tox"},                    // Python/tox
+    {"Gemfile", "vendor"},                  // Ruby
+    {"Cargo.toml", "target"},               // Rust
+    {"go.mod", "vendor"},                   // Go
+    {"pom.xml", "target"},                  // Maven
+    {"build.gradle", "build"},              // Gradle
+    {"build.gradle", ".gradle"},            // Gradle
+    {"build.gradle.kts", "build"},          // Gradle (Kotlin DSL)
+    {"build.gradle.kts", ".gradle"},        // Gradle (Kotlin DSL)
+    {"Podfile", "Pods"},                    // CocoaPods
+    {"Cartfile", "Carthage"},               // Carthage
+    {"Package.swift", ".build"},            // Swift PM
+    {".terraform.lock.hcl", ".terraform"},  // Terraform
+    {"bower.json", "bower_components"},     // Bower
+    {"pubspec.yaml", ".dart_tool"},         // Dart/Flutter
+    {"stack.yaml", ".stack-work"},          // Haskell Stack
+    {"mix.exs", "_build"},                  // Elixir
+    {"mix.exs", "deps"},                    // Elixir
+};
+
+// One rule a filename takes part in, and in which role. The pointer keeps
+// the rule reachable without the table it came from.
+struct RuleRef {
+  const Rule *rule;
+  uint8_t index;
+  bool isSentinel;
+};
+
+struct RuleName {
+  static constexpr size_t kMaxRefs = 8;
+
+  std::string_view name;
+  uint8_t refCount = 0;
+  RuleRef refs[kMaxRefs] = {};
+};
+
+// Filename -> rule dispatch through a perfect hash, searched for when the
+// table is built (at compile time for the built-in rules). A name that is
+// not part of any rule is usually rejected by the length mask alone;
+// otherwise by one hash of a few characters, one bucket load and one
+// compare. The cost does not grow with the number of rules.
+//
+// The fewer names per bucket, the sooner a seed is found; the chance of a
+// seed placing n names in m buckets is about exp(-n^2 / 2m).
+template <size_t MaxNames, size_t MinBuckets = 2 * MaxNames> class RuleTable {
+public:
+  constexpr RuleTable(const Rule *rules, size_t count)
+      : m_rules(rules), m_ruleCount(count) {
+    if (count > 255)
+      return;
+    for (size_t r = 0; r < count; ++r) {
+      if (!addRef(rules[r].key, {&rules[r], uint8_t(r), true}) ||
+          !addRef(rules[r].value, {&rules[r], uint8_t(r), false}))
+        return;
+    }
+    // Names that agree in length and sampled characters (say "s1.cfg" and
+    // "s2.cfg") collide under every seed; those tables hash whole names
+    for (bool fullHash : {false, true}) {
+      for (uint32_t seed = 1; seed < kMaxSeed; ++seed) {
+        if (tryPlace(seed, fullHash)) {
+          m_seed = seed;
+          m_fullHash = fullHash;
+          m_valid = true;
+          return;
+        }
+      }
+    }
+  }
+
+  // False if the rules did not fit or no perfect hash was found.
+  constexpr bool valid() const { return m_valid; }
+  constexpr size_t ruleCount() const { return m_ruleCount; }
+  constexpr const Rule &rule(size_t index) const { return m_rules[index]; }
+
+  constexpr const RuleName *find(std::string_view name) const {
+    size_t len = name.size();
+    if (len >= 64 || !((m_lengthMask >> len) & 1))
+      return nullptr;
+    uint8_t slot = m_buckets[hash(name, m_seed, m_fullHash) & (kBuckets - 1)];
+    if (slot == kEmpty || m_names[slot].name != name)
+      return nullptr;
+    return &m_names[slot];
+  }
+
+private:
+  static constexpr size_t kBuckets = [] {
+    size_t n = 1;
+    while (n < MinBuckets)
+      n <<= 1;
+    return n;
+  }();
+  static constexpr uint8_t kEmpty = 0xFF;
+  static constexpr uint32_t kMaxSeed = 4096;
+  static_assert(MaxNames < kEmpty, "slot indices must fit in uint8_t");
+
+  const Rule *m_rules;
+  size_t m_ruleCount;
+  RuleName m_names[MaxNames] = {};
+  size_t m_nameCount = 0;
+  uint8_t m_buckets[kBuckets] = {};
+  uint64_t m_lengthMask = 0;
+  uint32_t m_seed = 0;
+  bool m_fullHash = false;
+  bool m_valid = false;
+
+  // Mixes the length with the first, middle and last characters; cheap
+  // enough for every event and distinct enough for a seed search.
+  static constexpr uint32_t hash(std::string_view name, uint32_t seed,
+                                 bool fullHash) {
+    uint32_t h = seed * 0x9E3779B1u;
+    if (fullHash) {
+      for (char c : name)
+        h = (h ^ uint8_t(c)) * 0x01000193u; // FNV-1a
+      return h ^ (h >> 15);
+    }
+    h = (h ^ uint32_t(name.size())) * 0x85EBCA6Bu;
+    h = (h ^ uint8_t(name.front())) * 0xC2B2AE35u;
+    h = (h ^ uint8_t(name[name.size() / 2])) * 0x27D4EB2Fu;
+    h = (h ^ uint8_t(name.back())) * 0x165667B1u;
+    return h ^ (h >> 15);
+  }
+
+  constexpr bool addRef(std::string_view name, RuleRef ref) {
+    if (name.empty() || name.size() >= 64)
+      return false;
+    size_t i = 0;
+    while (i < m_nameCount && m_names[i].name != name)
+      ++i;
+    if (i == m_nameCount) {
+      if (m_nameCount == MaxNames)
+        return false;
+      m_names[m_nameCount++].name = name;
+      m_lengthMask |= uint64_t(1) << name.size();
+    }
+    RuleName &entry = m_names[i];
+    if (entry.refCount == RuleName::kMaxRefs)
+      return false;
+    entry.refs[entry.refCount++] = ref;
+    return true;
+  }
+
+  constexpr bool tryPlace(uint32_t seed, bool fullHash) {
+    for (size_t b = 0; b < kBuckets; ++b)
+      m_buckets[b] = kEmpty;
+    for (size_t i = 0; i < m_nameCount; ++i) {
+      uint8_t &bucket =
+          m_buckets[hash(m_names[i].name, seed, fullHash) & (kBuckets - 1)];
+      if (bucket != kEmpty)
+        return false;
+      bucket = uint8_t(i);
+    }
+    return true;
+  }
+};
+
+// --- Rule Configuration ---
+
+// Tables are built at runtime from the config file; the built-in rules
+// are checked against the same size at compile time. 4096 buckets keep
+// the seed search short up to about 200 names.
+constexpr size_t kMaxRuleNames = 254;
+using ConfigRuleTable = RuleTable<kMaxRuleNames, 4096>;
+
+static_assert(ConfigRuleTable(kBuiltinRules, sizeof(kBuiltinRules) /
+                                                 sizeof(kBuiltinRules[0]))
+                  .valid(),
+              "built-in rules need a bigger table or another hash");
+
+// What a config file asks for, before it is compiled.
+struct RuleSpec {
+  bool builtins = true;
+  std::vector<std::pair<std::string, std::string>> rules; // sentinel, target
+  std::vector<std::string> ignores;     // below every root, or absolute
+  std::vector<std::string> ignoreGlobs; // see RuleConfig::ignoredByGlob()
+  std::vector<std::string> pruneNames;
+
+  bool operator==(const RuleSpec &other) const {
+    return builtins == other.builtins && rules == other.rules &&
+           ignores == other.ignores && ignoreGlobs == other.ignoreGlobs &&
+           pruneNames == other.pruneNames;
+  }
+};
+
+// Reads a config file, one directive per line:
+//
+//   # comment
+//   builtins no                       # drop the built-in rules
+//   exclude target if Cargo.toml pom.xml
+//   exclude .venv venv env if pyproject.toml
+//   ignore Library/Caches             # below every root, or absolute
+//   ignore *.photoslibrary            # any directory with that name
+//   ignore Projects/*/tmp             # glob below every root
+//   prune .git                        # never scan into it
+//
+// An exclude line is every target with every sentinel. Rule names are
+// literal: they are dispatched through the filename hash on every event.
+static bool parseRuleSpec(std::istream &in, RuleSpec &spec,
+                          std::string &error) {
+  std::string line;
+  for (unsigned number = 1; std::getline(in, line); ++number) {
+    size_t hash = line.find('#');
+    if (hash != std::string::npos)
+      line.resize(hash);
+    std::istringstream fields(line);
+    std::vector<std::string> words;
+    for (std::string word; fields >> word;)
+      words.push_back(word);
+    if (words.empty())
+      continue;
+
+    const std::string &key = words[0];
+    std::string where = "line " + std::to_string(number) + ": ";
+    if (key == "builtins" && words.size() == 2 &&
+        (words[1] == "yes" || words[1] == "no")) {
+      spec.builtins = words[1] == "yes";
+    } else if (key == "exclude") {
+      auto sep = std::find(words.begin(), words.end(), "if");
+      std::vector<std::string> targets(words.begin() + 1, sep);
+      std::vector<std::string> sentinels(
+          sep == words.end() ? sep : sep + 1, words.end());
+      if (targets.empty() || sentinels.empty()) {
+        error = where + "expected exclude TARGET... if SENTINEL...";
+        return false;
+      }
+      for (const auto &name : words) {
+        if (name.find_first_of("/*?[") != std::string::npos) {
+          error = where + "rule names must be plain file names: " + name;
+          return false;
+        }
+      }
+      for (const auto &sentinel : sentinels) {
+        for (const auto &target : targets)
+          spec.rules.emplace_back(sentinel, target);
+      }
+    } else if (key == "ignore" && words.size() == 2) {
+      if (words[1].find_first_of("*?[") != std::string::npos)
+        spec.ignoreGlobs.push_back(words[1]);
+      else
+        spec.ignores.push_back(words[1]);
+    } else if (key == "prune" && words.size() == 2) {
+      spec.pruneNames.push_back(words[1]);
+    } else {
+      error = where + "unknown directive: " + line;
+      return false;
+    }
+  }
+  return true;
+}
+
+// A compiled RuleSpec: rules in the filename hash table, plus the globs
+// and prune names. Immutable once built; a reload swaps in a new one.
+// Owns the names the table's views point to.
+class RuleConfig {
+public:
+  // Null, with an error, if the rules don't fit the table.
+  static std::unique_ptr<RuleConfig> compile(const RuleSpec &spec,
+                                             std::string &error) {
+    std::unique_ptr<RuleConfig> config(new RuleConfig(spec));
+    if (!config->m_table.valid()) {
+      error = "rules don't fit the table (at most " +
+              std::to_string(kMaxRuleNames) + " names, " +
+              std::to_string(RuleName::kMaxRefs) + " rules per name)";
+      return nullptr;
+    }
+    return config;
+  }
+
+  const RuleSpec &spec() const { return m_spec; }
+  const ConfigRuleTable &table() const { return m_table; }
+  size_t ruleCount() const { return m_rules.size(); }
+
+  bool isPrunedName(std::string_view name) const {
+    for (const auto &pruned : m_spec.pruneNames) {
+      if (name == pruned)
+        return true;
+    }
+    return false;
+  }
+
+  // relative is below a watch root. A glob without '/' matches any of its
+  // components, one with '/' the path from the root down (and everything
+  // below that). Free without globs, which is the common case.
+  bool ignoredByGlob(std::string_view relative) const {
+    if (m_spec.ignoreGlobs.empty())
+      return false;
+    thread_local std::string path, component;
+    path.assign(relative.data(), relative.size());
+    for (const auto &glob : m_spec.ignoreGlobs) {
+      if (glob.find('/') != std::string::npos) {
+        if (fnmatch(glob.c_str(), path.c_str(),
+                    FNM_PATHNAME | FNM_LEADING_DIR) == 0)
+          return true;
+        continue;
+      }
+      for (size_t start = 0; start < path.size();) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+          end = path.size();
+        component.assign(path, start, end - start);
+        if (fnmatch(glob.c_str(), component.c_str(), 0) == 0)
+          return true;
+        start = end + 1;
+      }
+    }
+    return false;
+  }
+
+private:
+  RuleSpec m_spec;
+  std::deque<std::string> m_names; // Stable storage for m_rules' views
+  std::vector<Rule> m_rules;
+  ConfigRuleTable m_table;
+
+  explicit RuleConfig(const RuleSpec &spec)
+      : m_spec(spec), m_rules(intern()),
+        m_table(m_rules.data(), m_rules.size()) {}
+
+  std::vector<Rule> intern() {
+    std::vector<std::pair<std::string, std::string>> pairs;
+    if (m_spec.builtins) {
+      for (const Rule &rule : kBuiltinRules)
+        pairs.emplace_back(rule.key, rule.value);
+    }
+    // Duplicates would only cost probes. Order is kept, so identical
+    // specs compile to identical tables.
+    for (const auto &pair : m_spec.rules) {
+      if (std::find(pairs.begin(), pairs.end(), pair) == pairs.end())
+        pairs.push_back(pair);
+    }
+    std::vector<Rule> rules;
+    for (const auto &pair : pairs) {
+      m_names.push_back(pair.first);
+      std::string_view key = m_names.back();
+      m_names.push_back(pair.second);
+      rules.push_back({key, m_names.back()});
+    }
+    return rules;
+  }
+};
+
+// Persisted stream position. Lets a restart replay only the FSEvents history
+// since the last processed event instead of walking the whole watch root.
+struct CheckpointRoot {
+  std::string path;
+  std::string deviceUUID;
+};
+
+struct Checkpoint {
+  std::vector<CheckpointRoot> roots; // sorted by path
+  FSEventStreamEventId eventId = 0;
+};
+
+struct RootOptions {
+  std::string path;
+  std::vector<std::string> ignores; // relative to path
+};
+
+struct Options {
+  std::vector<RootOptions> roots;
+  unsigned scanThreads = 0; // 0 = one per core
+  // Directory names the scanner never descends into (e.g. ".git")
+  std::vector<std::string> pruneNames;
+  std::string backend = "native"; // see makeExclusionBackend()
+  // How long candidates from events are collected before they are checked
+  unsigned debounceMs = 250;
+  // Directory-level FSEvents instead of one event per file
+  bool dirEvents = false;
+  bool noDefer = false;
+  double latency = 1.0;    // seconds
+  double maxLatency = 0.0; // > latency enables adaptive latency
+  unsigned eventShards = 0; // 0 = one per core
+  std::string metricsSocket; // empty = SIGUSR1 only
+  std::string configPath;    // empty = the default, if it exists
+  // Background scan scheduling, see ScanThrottle
+  std::string scanQos = "utility";
+  unsigned scanRate = 0; // entries/s, 0 = unlimited
+  unsigned scanMemoryMb = 64; // work stacks, 0 = unlimited
+  bool pauseOnBattery = false;
+  bool pauseOnThermal = false;
+  std::string volumes = "local"; // see parseVolumePolicy()
+  bool deviceStreams = false;
+  bool signposts = false; // os_signpost intervals for every exclusion
+  std::string logLevel = "debug"; // see parseLogLevel()
+  std::string logFile;            // empty = stdout/stderr, no rotation
+  unsigned logMaxSizeMb = 10;     // rotate --log-file past this size
+  bool dryRun = false; // --backend none
+  bool report = false; // with dryRun: scan once, report and exit
+  // --bench: generated tree and synthetic event storms instead of watching
+  bool bench = false;
+  unsigned benchProjects = 200;
+  unsigned benchFiles = 20; // files per directory
+  unsigned benchEvents = 100000; // per storm
+};
+
+// --- Allocation Accounting ---
+
+// Per-thread count of heap allocations, used to verify that the event hot
+// path stays allocation-free. Replacing the global operator new costs one
+// TLS increment per allocation.
+static thread_local uint64_t t_allocations = 0;
+
+void *operator new(size_t size) {
+  ++t_allocations;
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Per-thread count of probing syscalls (getxattr, access, and the opens
+// and closes of DirFdCache), same idea as t_allocations.
+static thread_local uint64_t t_probes = 0;
+
+// --- Metrics ---
+
+// Latency histogram with power-of-two microsecond buckets: bucket 0 holds
+// durations under 1us, bucket b [2^(b-1), 2^b) us. Lock-free, so any
+// thread may record while the metrics dump reads it.
+class LatencyHistogram {
+public:
+  void record(std::chrono::steady_clock::duration elapsed) {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                      elapsed)
+                      .count();
+    size_t bucket = 0;
+    while (bucket + 1 < kBuckets && (uint64_t(1) << bucket) <= us)
+      ++bucket;
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sumUs.fetch_add(us, std::memory_order_relaxed);
+    uint64_t max = m_maxUs.load(std::memory_order_relaxed);
+    while (us > max &&
+           !m_maxUs.compare_exchange_weak(max, us, std::memory_order_relaxed))
+      ;
+  }
+
+  // Upper bound of the bucket that holds the q-quantile, in microseconds
+  uint64_t percentile(double q) const {
+    uint64_t count = m_count.load(std::memory_order_relaxed);
+    uint64_t rank = uint64_t(q * count), seen = 0;
+    for (size_t b = 0; b < kBuckets; ++b) {
+      seen += m_buckets[b].load(std::memory_order_relaxed);
+      if (seen > rank)
+        return b ? uint64_t(1) << b : 1;
+    }
+    return m_maxUs.load(std::memory_order_relaxed);
+  }
+
+  void writeJson(std::ostream &out) const {
+    out << "{\"count\":" << m_count.load(std::memory_order_relaxed)
+        << ",\"sum_us\":" << m_sumUs.load(std::memory_order_relaxed)
+        << ",\"max_us\":" << m_maxUs.load(std::memory_order_relaxed)
+        << ",\"p50_us\":" << percentile(0.50)
+        << ",\"p99_us\":" << percentile(0.99) << ",\"buckets\":[";
+    size_t last = kBuckets;
+    while (last > 1 && m_buckets[last - 1].load() == 0)
+      --last;
+    for (size_t b = 0; b < last; ++b)
+      out << (b ? "," : "") << m_buckets[b].load(std::memory_order_relaxed);
+    out << "]}";
+  }
+
+private:
+  static constexpr size_t kBuckets = 32; // The last one is open-ended
+  std::atomic<uint64_t> m_buckets[kBuckets]{};
+  std::atomic<uint64_t> m_count{0};
+  std::atomic<uint64_t> m_sumUs{0};
+  std::atomic<uint64_t> m_maxUs{0};
+};
+
+// Records the time until it goes out of scope.
+class ScopedLatency {
+public:
+  explicit ScopedLatency(LatencyHistogram &histogram)
+      : m_histogram(histogram), m_started(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() {
+    m_histogram.record(std::chrono::steady_clock::now() - m_started);
+  }
+
+private:
+  LatencyHistogram &m_histogram;
+  std::chrono::steady_clock::time_point m_started;
+};
+
+// When the event behind a piece of work reached the FSEvents callback, so
+// the work can be timed end to end. FSEvents' own latency before the
+// callback is not seen. Empty for work that didn't come from an event,
+// e.g. the scan.
+struct EventTrace {
+  std::chrono::steady_clock::time_point arrived{};
+  FSEventStreamEventId eventId = 0; // 0 for per-device streams
+
+  explicit operator bool() const {
+    return arrived != std::chrono::steady_clock::time_point();
+  }
+
+  // Coalesced work is as old as its oldest event
+  void merge(const EventTrace &other) {
+    if (other && (!*this || other.arrived < arrived))
+      *this = other;
+  }
+};
+
+static bool writeFully(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// --- Logging ---
+
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error };
+
+class Logger;
+static Logger &logger();
+
+// Asynchronous line logger. Callers format into a thread-local buffer and
+// copy the line into a bounded lock-free ring (Vyukov's MPMC queue, with a
+// single consumer); a background thread writes whatever has piled up with
+// one write(2) per batch and rotates the log file by size. A full ring
+// drops lines rather than blocking the caller.
+class Logger {
+public:
+  Logger() {
+    for (size_t i = 0; i < kSlots; ++i)
+      m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool enabled(LogLevel level) const {
+    return level >= m_level.load(std::memory_order_relaxed);
+  }
+  LogLevel level() const { return m_level; }
+  void setLevel(LogLevel level) { m_level = level; }
+
+  // Starts the writer. Without a path, lines go to stdout (WARN and ERROR
+  // to stderr), which launchd points at the log file; only with a path of
+  // our own can the log be rotated.
+  void start(const std::string &path, uint64_t maxBytes) {
+    m_path = path;
+    m_maxBytes = maxBytes;
+    if (!m_path.empty())
+      openFile();
+    m_wake = dispatch_semaphore_create(0);
+    m_started = true;
+    std::thread([this] { writerLoop(); }).detach();
+    std::atexit([] { logger().flush(); });
+  }
+
+  void submit(LogLevel level, const std::string &line) {
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &m_slots[pos & (kSlots - 1)];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+      if (diff == 0) {
+        if (m_enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return; // Full: the writer is behind, don't wait for it
+      } else {
+        pos = m_enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    slot->level = level;
+    slot->text.assign(line); // Reuses the slot's capacity once warm
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    if (m_writerIdle.exchange(false))
+      dispatch_semaphore_signal(m_wake);
+  }
+
+  // Waits, for a second at most, until every line submitted so far has
+  // been written. Runs at exit.
+  void flush() {
+    if (!m_started)
+      return;
+    size_t target = m_enqueuePos.load();
+    for (int i = 0; i < 1000 && m_writtenPos.load() < target; ++i) {
+      if (m_writerIdle.exchange(false))
+        dispatch_semaphore_signal(m_wake);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+private:
+  static constexpr size_t kSlots = 1024; // Power of two
+  static constexpr int kBackups = 3;     // log.1 ... log.3
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    std::string text;
+  };
+
+  Slot m_slots[kSlots];
+  std::atomic<size_t> m_enqueuePos{0};
+  size_t m_dequeuePos = 0; // Writer thread only
+  std::atomic<size_t> m_writtenPos{0};
+  std::atomic<uint64_t> m_dropped{0};
+  std::atomic<bool> m_writerIdle{false};
+  std::atomic<LogLevel> m_level{LogLevel::Debug};
+  dispatch_semaphore_t m_wake = nullptr;
+  bool m_started = false;
+
+  std::string m_path;
+  uint64_t m_maxBytes = 0;
+  int m_fd = -1;
+  uint64_t m_fileBytes = 0;
+
+  void writerLoop() {
+    std::string out, err;
+    for (;;) {
+      if (drain(out, err))
+        continue;
+      // Announce the nap before the last look, so a line submitted in
+      // between always wakes us
+      m_writerIdle = true;
+      if (drain(out, err))
+        continue;
+      dispatch_semaphore_wait(m_wake, DISPATCH_TIME_FOREVER);
+    }
+  }
+
+  // Writes everything in the ring; false if there was nothing.
+  bool drain(std::string &out, std::string &err) {
+    out.clear();
+    err.clear();
+    if (uint64_t dropped = m_dropped.exchange(0))
+      err += "WARN: " + std::to_string(dropped) + " log lines dropped\n";
+    for (;;) {
+      Slot &slot = m_slots[m_dequeuePos & (kSlots - 1)];
+      if (slot.sequence.load(std::memory_order_acquire) != m_dequeuePos + 1)
+        break;
+      bool toErr = m_fd < 0 && slot.level >= LogLevel::Warn;
+      (toErr ? err : out) += slot.text;
+      slot.sequence.store(m_dequeuePos + kSlots, std::memory_order_release);
+      ++m_dequeuePos;
+    }
+    if (out.empty() && err.empty())
+      return false;
+
+    if (m_fd >= 0) {
+      out += err;
+      writeFully(m_fd, out.data(), out.size());
+      m_fileBytes += out.size();
+      if (m_maxBytes && m_fileBytes >= m_maxBytes)
+        rotate();
+    } else {
+      writeFully(STDOUT_FILENO, out.data(), out.size());
+      writeFully(STDERR_FILENO, err.data(), err.size());
+    }
+    m_writtenPos = m_dequeuePos;
+    return true;
+  }
+
+  void openFile() {
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                0644);
+    struct stat st;
+    m_fileBytes = (m_fd >= 0 && fstat(m_fd, &st) == 0) ? st.st_size : 0;
+  }
+
+  void rotate() {
+    close(m_fd);
+    for (int i = kBackups - 1; i >= 1; --i)
+      rename((m_path + "." + std::to_string(i)).c_str(),
+             (m_path + "." + std::to_string(i + 1)).c_str());
+    rename(m_path.c_str(), (m_path + ".1").c_str());
+    openFile(); // Falls back to stdout if this fails
+  }
+};
+
+// Never destroyed: the writer thread outlives static destruction.
+static Logger &logger() {
+  static Logger *instance = new Logger();
+  return *instance;
+}
+
+// Formats one line into a reused thread-local buffer and submits it when
+// it goes out of scope. Use through the LOG_* macros.
+class LogMessage {
+public:
+  explicit LogMessage(LogLevel level) : m_level(level) {
+    Buffer &buffer = threadBuffer();
+    buffer.sink.text.clear();
+    buffer.stream.flags(buffer.defaultFlags);
+    buffer.stream.precision(6);
+    appendTimestamp(buffer.sink.text);
+    switch (level) {
+    case LogLevel::Debug:
+      buffer.sink.text += "DEBUG: ";
+      break;
+    case LogLevel::Info:
+      break;
+    case LogLevel::Warn:
+      buffer.sink.text += "WARN: ";
+      break;
+    case LogLevel::Error:
+      buffer.sink.text += "ERROR: ";
+      break;
+    }
+  }
+
+  ~LogMessage() {
+    Buffer &buffer = threadBuffer();
+    buffer.sink.text += '\n';
+    logger().submit(m_level, buffer.sink.text);
+  }
+
+  std::ostream &stream() { return threadBuffer().stream; }
+
+private:
+  class StringSink : public std::streambuf {
+  public:
+    std::string text;
+
+  protected:
+    int_type overflow(int_type c) override {
+      if (c != traits_type::eof())
+        text += traits_type::to_char_type(c);
+      return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+      text.append(s, n);
+      return n;
+    }
+  };
+
+  struct Buffer {
+    StringSink sink;
+    std::ostream stream{&sink};
+    std::ios::fmtflags defaultFlags = stream.flags();
+  };
+
+  static Buffer &threadBuffer() {
+    thread_local Buffer buffer;
+    return buffer;
+  }
+
+  static void appendTimestamp(std::string &out) {
+    auto now = std::chrono::system_clock::now();
+    time_t seconds = std::chrono::system_clock::to_time_t(now);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char stamp[32];
+    size_t length =
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  now.time_since_epoch())
+                  .count() %
+              1000;
+    snprintf(stamp + length, sizeof(stamp) - length, ".%03d ", int(ms));
+    out += stamp;
+  }
+
+  LogLevel m_level;
+};
+
+static bool parseLogLevel(const std::string &name, LogLevel &level) {
+  static const std::pair<const char *, LogLevel> kLevels[] = {
+      {"debug", LogLevel::Debug},
+      {"info", LogLevel::Info},
+      {"warn", LogLevel::Warn},
+      {"error", LogLevel::Error},
+  };
+  for (const auto &entry : kLevels) {
+    if (name == entry.first) {
+      level = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+#define LOG_AT(level, message)                                                 \
+  do {                                                                         \
+    if (logger().enabled(level)) {                                             \
+      LogMessage logMessage(level);                                            \
+      logMessage.stream() << message;                                          \
+    }                                                                          \
+  } while (0)
+
+// Build with -DASIMOV_NO_DEBUG_LOG to compile DEBUG lines out entirely
+#ifdef ASIMOV_NO_DEBUG_LOG
+#define LOG_DEBUG(message)                                                     \
+  do {                                                                         \
+  } while (0)
+#else
+#define LOG_DEBUG(message) LOG_AT(LogLevel::Debug, message)
+#endif
+#define LOG_INFO(message) LOG_AT(LogLevel::Info, message)
+#define LOG_WARN(message) LOG_AT(LogLevel::Warn, message)
+#define LOG_ERROR(message) LOG_AT(LogLevel::Error, message)
+
+static constexpr const char *kExcludeXattr =
+    "com.apple.metadata:com_apple_backup_excludeItem";
+
+static bool isExcludedFast(const char *path) {
+  ++t_probes;
+  char value[1024];
+  ssize_t len = getxattr(path, kExcludeXattr, value, sizeof(value), 0, 0);
+  return (len > 0);
+}
+
+// Same on an open file or directory, without resolving its path again
+static bool isExcludedFd(int fd) {
+  ++t_probes;
+  char value[1024];
+  ssize_t len = fgetxattr(fd, kExcludeXattr, value, sizeof(value), 0, 0);
+  return (len > 0);
+}
+
+// --- Path Arena ---
+
+// Monotonic storage for transient paths and names: storing one is a copy
+// and a pointer bump, and reset() drops them all at once while keeping the
+// blocks for the next round, so a batch of thousands of paths costs no
+// malloc/free pairs once warm. Every string is NUL-terminated, so a view's
+// data() can go straight to a syscall. Views stay valid until reset().
+class PathArena {
+public:
+  explicit PathArena(size_t blockSize = 64 * 1024) : m_blockSize(blockSize) {}
+
+  std::string_view store(std::string_view s) {
+    char *out = allocate(s.size() + 1);
+    std::memcpy(out, s.data(), s.size());
+    out[s.size()] = '\0';
+    return {out, s.size()};
+  }
+
+  // dir + '/' + name, like fs::path's operator/
+  std::string_view join(std::string_view dir, std::string_view name) {
+    bool slash = dir.empty() || dir.back() != '/';
+    size_t size = dir.size() + slash + name.size();
+    char *out = allocate(size + 1);
+    std::memcpy(out, dir.data(), dir.size());
+    if (slash)
+      out[dir.size()] = '/';
+    std::memcpy(out + dir.size() + slash, name.data(), name.size());
+    out[size] = '\0';
+    return {out, size};
+  }
+
+  // Blocks beyond the first kKeepBlocks only served an unusually big round
+  // and are freed.
+  void reset() {
+    if (m_blocks.size() > kKeepBlocks)
+      m_blocks.resize(kKeepBlocks);
+    m_current = 0;
+    m_used = 0;
+  }
+
+  size_t capacity() const {
+    size_t bytes = 0;
+    for (const auto &block : m_blocks)
+      bytes += block.size;
+    return bytes;
+  }
+
+private:
+  static constexpr size_t kKeepBlocks = 4;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  char *allocate(size_t bytes) {
+    while (m_current < m_blocks.size()) {
+      Block &block = m_blocks[m_current];
+      if (block.size - m_used >= bytes) {
+        char *out = block.data.get() + m_used;
+        m_used += bytes;
+        return out;
+      }
+      ++m_current;
+      m_used = 0;
+    }
+    size_t size = std::max(bytes, m_blockSize);
+    m_blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+    m_current = m_blocks.size() - 1;
+    m_used = bytes;
+    return m_blocks.back().data.get();
+  }
+
+  size_t m_blockSize;
+  std::vector<Block> m_blocks;
+  size_t m_current = 0; // block being filled
+  size_t m_used = 0;    // bytes of it handed out
+};
+
+// --- Directory Enumeration ---
+
+enum class EntryType { File, Directory, Symlink, Other };
+
+// name points into the lister's arena, see BulkDirectoryReader::list()
+struct DirEntry {
+  std::string_view name;
+  EntryType type;
+  uint64_t size = 0; // allocated bytes of a file, if sizes were asked for
+};
+
+// Counters for the initial scan. Shared by all scan workers.
+struct ScanStats {
+  std::atomic<uint64_t> entries{0};
+  std::atomic<uint64_t> syscalls{0};
+  std::atomic<uint64_t> prunedTargets{0};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> directories{0};
+  std::atomic<uint64_t> stackPeakBytes{0}; // of the last finished scan
+
+  void reset() {
+    entries = 0;
+    syscalls = 0;
+    prunedTargets = 0;
+    allocations = 0;
+    directories = 0;
+    stackPeakBytes = 0;
+  }
+};
+
+// Lists a directory with getattrlistbulk(2): one syscall returns the names
+// and object types of a whole batch of entries, so no per-entry stat is
+// needed to tell files from directories.
+class BulkDirectoryReader {
+public:
+  // The names live in a per-thread arena and stay valid until the next
+  // list() on the same thread. withSizes also fetches the allocated size of
+  // every file, in the same syscalls.
+  static bool list(const std::string &dir, std::vector<DirEntry> &out,
+                   ScanStats &stats, bool withSizes = false) {
+    out.clear();
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ++stats.syscalls;
+    if (fd < 0)
+      return false;
+    bool ok = list(fd, dir, out, stats, withSizes);
+    close(fd);
+    ++stats.syscalls;
+    return ok;
+  }
+
+  // Lists the directory open at fd, from its current offset; the caller
+  // keeps the fd. dir is only needed for the fallback.
+  static bool list(int fd, const std::string &dir, std::vector<DirEntry> &out,
+                   ScanStats &stats, bool withSizes = false) {
+    out.clear();
+    names().reset();
+
+    struct attrlist attrs = {};
+    attrs.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attrs.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME |
+                       ATTR_CMN_ERROR | ATTR_CMN_OBJTYPE;
+    // Only returned for files; directories come back without it
+    if (withSizes)
+      attrs.fileattr = ATTR_FILE_ALLOCSIZE;
+
+    bool ok = true;
+    for (;;) {
+      int count = getattrlistbulk(fd, &attrs, buffer(), kBufferSize, 0);
+      ++stats.syscalls;
+      if (count == 0)
+        break;
+      if (count < 0) {
+        // Filesystems without bulk support: fall back to the iterator
+        ok = (errno == ENOTSUP || errno == EINVAL) &&
+             listFallback(dir, out, withSizes);
+        break;
+      }
+      parseBatch(buffer(), count, out);
+    }
+
+    stats.entries += out.size();
+    return ok;
+  }
+
+private:
+  static constexpr size_t kBufferSize = 128 * 1024;
+
+  static char *buffer() {
+    thread_local std::vector<char> buf(kBufferSize);
+    return buf.data();
+  }
+
+  static PathArena &names() {
+    thread_local PathArena arena;
+    return arena;
+  }
+
+  // Layout per entry (see getattrlistbulk(2)): length, returned attribute
+  // set, then each requested attribute in bit order, except ATTR_CMN_ERROR
+  // which immediately follows the returned set.
+  static void parseBatch(const char *batch, int count,
+                         std::vector<DirEntry> &out) {
+    const char *entry = batch;
+    for (int i = 0; i < count; ++i) {
+      const char *field = entry;
+      uint32_t length = *reinterpret_cast<const uint32_t *>(field);
+      field += sizeof(uint32_t);
+      entry += length;
+
+      attribute_set_t returned =
+          *reinterpret_cast<const attribute_set_t *>(field);
+      field += sizeof(attribute_set_t);
+
+      if (returned.commonattr & ATTR_CMN_ERROR) {
+        uint32_t error = *reinterpret_cast<const uint32_t *>(field);
+        field += sizeof(uint32_t);
+        if (error != 0)
+          continue;
+      }
+      if (!(returned.commonattr & ATTR_CMN_NAME))
+        continue;
+
+      const attrreference_t *nameRef =
+          reinterpret_cast<const attrreference_t *>(field);
+      const char *name = field + nameRef->attr_dataoffset;
+      field += sizeof(attrreference_t);
+
+      EntryType type = EntryType::Other;
+      if (returned.commonattr & ATTR_CMN_OBJTYPE) {
+        switch (*reinterpret_cast<const fsobj_type_t *>(field)) {
+        case VREG:
+          type = EntryType::File;
+          break;
+        case VDIR:
+          type = EntryType::Directory;
+          break;
+        case VLNK:
+          type = EntryType::Symlink;
+          break;
+        default:
+          break;
+        }
+        field += sizeof(fsobj_type_t);
+      }
+      uint64_t size = 0;
+      if (returned.fileattr & ATTR_FILE_ALLOCSIZE) {
+        off_t allocated;
+        memcpy(&allocated, field, sizeof(allocated)); // Only 4-byte aligned
+        size = uint64_t(allocated);
+      }
+      out.push_back({names().store(name), type, size});
+    }
+  }
+
+  static bool listFallback(const std::string &dir, std::vector<DirEntry> &out,
+                           bool withSizes) {
+    out.clear();
+    std::error_code ec;
+    fs::directory_iterator it(dir, ec);
+    if (ec)
+      return false;
+    for (const auto &entry : it) {
+      EntryType type = EntryType::Other;
+      if (entry.is_symlink(ec))
+        type = EntryType::Symlink;
+      else if (entry.is_directory(ec))
+        type = EntryType::Directory;
+      else if (entry.is_regular_file(ec))
+        type = EntryType::File;
+      struct stat st;
+      uint64_t size = 0;
+      if (withSizes && type == EntryType::File &&
+          lstat(entry.path().c_str(), &st) == 0)
+        size = uint64_t(st.st_blocks) * 512;
+      out.push_back(
+          {names().store(entry.path().filename().native()), type, size});
+    }
+    return true;
+  }
 };
 
-class AsimovWatcher {
-public:
-  AsimovWatcher(const std::string &watchPath,
-                const std::vector<std::string> &ignores)
-      : m_watchRoot(watchPath) {
-
-    // Rules configuration
-    m_sentinels = {{"package.json", "node_modules"},
-                   {"composer.json", "vendor"},
-                   {"requirements.txt", "venv"},
-                   {"Gemfile", "vendor"},
-                   {"Cargo.toml", "target"}};
-
-    // Pre-calculate absolute ignore paths for efficient checking
-    m_absoluteIgnorePrefixes.reserve(ignores.size());
-    for (const auto &ignoreDir : ignores) {
-      if (ignoreDir.empty())
+// Open descriptors of recently used directories, so opening a directory
+// below one of them resolves only the remaining components instead of the
+// whole path from '/'. Least recently used entries are closed first. Held
+// descriptors keep a volume from unmounting, so owners clear() the cache
+// when a batch of work is done. Not thread safe.
+class DirFdCache {
+public:
+  explicit DirFdCache(size_t capacity) : m_capacity(capacity) {}
+  DirFdCache(const DirFdCache &) = delete;
+  DirFdCache &operator=(const DirFdCache &) = delete;
+  ~DirFdCache() { clear(); }
+
+  // The cache keeps ownership of the returned fd; -1 if dir can't be
+  // opened for reading. Pass listing if the directory is about to be read:
+  // an fd that was read before is rewound first.
+  int open(std::string_view dir, bool listing = false) {
+    Entry *base = nullptr;
+    for (auto &entry : m_entries) {
+      if (dir == entry.path) {
+        entry.used = ++m_clock;
+        if (listing && entry.listed) {
+          lseek(entry.fd, 0, SEEK_SET);
+          ++t_probes;
+        }
+        entry.listed |= listing;
+        return entry.fd;
+      }
+      // The deepest cached ancestor
+      if (dir.size() > entry.path.size() &&
+          dir.compare(0, entry.path.size(), entry.path) == 0 &&
+          dir[entry.path.size()] == '/' &&
+          (!base || entry.path.size() > base->path.size()))
+        base = &entry;
+    }
+
+    // openat() wants a NUL-terminated path
+    if (base) {
+      m_scratch.assign(dir.substr(base->path.size() + 1));
+      base->used = ++m_clock;
+    } else {
+      m_scratch.assign(dir);
+    }
+    int baseFd = base ? base->fd : AT_FDCWD;
+    int fd = openDirectory(baseFd, m_scratch.c_str());
+    if (fd < 0 && (errno == EMFILE || errno == ENFILE) && !m_entries.empty()) {
+      // Out of descriptors: give ours back and resolve the whole path
+      m_scratch.assign(dir);
+      clear();
+      fd = openDirectory(AT_FDCWD, m_scratch.c_str());
+    }
+    if (fd < 0)
+      return -1;
+    insert(dir, fd, listing);
+    return fd;
+  }
+
+  void clear() {
+    for (const auto &entry : m_entries) {
+      ::close(entry.fd);
+      ++t_probes;
+    }
+    m_entries.clear();
+  }
+
+private:
+  struct Entry {
+    std::string path;
+    int fd;
+    uint64_t used;
+    bool listed; // the fd's offset moved
+  };
+
+  static int openDirectory(int baseFd, const char *path) {
+    ++t_probes;
+    return openat(baseFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  void insert(std::string_view dir, int fd, bool listed) {
+    if (m_entries.size() < m_capacity) {
+      m_entries.push_back({std::string(dir), fd, ++m_clock, listed});
+      return;
+    }
+    auto victim = std::min_element(
+        m_entries.begin(), m_entries.end(),
+        [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    ::close(victim->fd);
+    ++t_probes;
+    victim->path.assign(dir.data(), dir.size());
+    victim->fd = fd;
+    victim->used = ++m_clock;
+    victim->listed = listed;
+  }
+
+  size_t m_capacity;
+  std::vector<Entry> m_entries;
+  uint64_t m_clock = 0;
+  std::string m_scratch;
+};
+
+// --- Scan Scheduling ---
+
+// True while the Mac draws from its battery.
+static bool onBatteryPower() {
+  CFTypeRef info = IOPSCopyPowerSourcesInfo();
+  if (!info)
+    return false; // No power source information: a desktop
+  CFStringRef source = IOPSGetProvidingPowerSourceType(info);
+  bool battery = source && CFStringCompare(source, CFSTR(kIOPMBatteryPower),
+                                           0) == kCFCompareEqualTo;
+  CFRelease(info);
+  return battery;
+}
+
+// True at "moderate" thermal pressure or worse, the level at which the
+// system itself starts deferring discretionary work. The notify key and
+// levels are those of <libkern/OSThermalNotification.h>.
+static bool underThermalPressure() {
+  static const int token = [] {
+    int t;
+    return notify_register_check("com.apple.system.thermalpressurelevel",
+                                 &t) == NOTIFY_STATUS_OK
+               ? t
+               : -1;
+  }();
+  uint64_t level = 0;
+  if (token < 0 || notify_get_state(token, &level) != NOTIFY_STATUS_OK)
+    return false;
+  return level >= 1; // kOSThermalPressureLevelModerate
+}
+
+// How background scans share the machine with the user. Scan threads run
+// at a lower QoS class with throttled disk I/O, can be held to a budget of
+// entries per second, and optionally wait while on battery or under
+// thermal pressure. The event path never goes through here.
+class ScanThrottle {
+public:
+  enum class QoS { Default, Utility, Background };
+
+  struct Policy {
+    QoS qos = QoS::Utility;
+    uint64_t entriesPerSecond = 0; // 0 = unlimited
+    bool pauseOnBattery = false;
+    bool pauseOnThermal = false;
+  };
+
+  static bool parseQoS(const std::string &name, QoS &qos) {
+    if (name == "default")
+      qos = QoS::Default;
+    else if (name == "utility")
+      qos = QoS::Utility;
+    else if (name == "background")
+      qos = QoS::Background;
+    else
+      return false;
+    return true;
+  }
+
+  void configure(const Policy &policy) { m_policy = policy; }
+
+  // Global queue to start scans from.
+  dispatch_queue_t queue() const {
+    return dispatch_get_global_queue(qosClass(), 0);
+  }
+
+  // Called on each scan thread before its first directory. Utility I/O is
+  // throttled while other processes wait on the same disk, background I/O
+  // more aggressively still.
+  void enterWorker() const {
+    if (m_policy.qos == QoS::Default)
+      return;
+    pthread_set_qos_class_self_np(qosClass(), 0);
+    setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD,
+                   m_policy.qos == QoS::Background ? IOPOL_THROTTLE
+                                                   : IOPOL_UTILITY);
+  }
+
+  // Charges one listed directory against the budget. Blocks the calling
+  // scan thread while over budget or while scans are paused.
+  void pace(size_t entries) {
+    if (m_policy.pauseOnBattery || m_policy.pauseOnThermal)
+      waitUntilUnconstrained();
+    if (!m_policy.entriesPerSecond)
+      return;
+
+    // Token bucket shared by all scan threads, holding up to one second of
+    // budget
+    std::chrono::duration<double> wait;
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      auto now = std::chrono::steady_clock::now();
+      double rate = double(m_policy.entriesPerSecond);
+      std::chrono::duration<double> elapsed = now - m_refilled;
+      m_refilled = now;
+      m_allowance = std::min(rate, m_allowance + rate * elapsed.count());
+      m_allowance -= double(entries);
+      if (m_allowance >= 0)
+        return;
+      wait = std::chrono::duration<double>(-m_allowance / rate);
+      // Wall time with at least one thread held back: the sleeps of
+      // several threads overlap, so only what extends past the latest
+      // one counts
+      auto until =
+          now + std::chrono::duration_cast<std::chrono::microseconds>(wait);
+      if (until > m_throttledUntil) {
+        m_throttledUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                             until - std::max(now, m_throttledUntil))
+                             .count();
+        m_throttledUntil = until;
+      }
+    }
+    std::this_thread::sleep_for(wait);
+  }
+
+  // Wall time, not summed over scan threads
+  uint64_t throttledMs() const { return m_throttledUs / 1000; }
+  uint64_t pausedMs() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    uint64_t paused = m_pausedMs;
+    if (m_paused)
+      paused += uint64_t(nowMs() - m_pausedSince);
+    return paused;
+  }
+
+private:
+  enum Constraint { kNone, kBattery, kThermal };
+  static constexpr std::chrono::seconds kPausePoll{5};
+
+  Policy m_policy;
+  mutable std::mutex m_lock;
+  std::chrono::steady_clock::time_point m_refilled;
+  double m_allowance = 0;
+  std::chrono::steady_clock::time_point m_throttledUntil;
+  std::atomic<uint64_t> m_throttledUs{0};
+  // Pauses are timed once from first thread in to first thread out;
+  // guarded by m_lock
+  uint64_t m_pausedMs = 0;
+  int64_t m_pausedSince = 0;
+  bool m_paused = false;
+  // Sampled at most once a second: the checks cost IPC
+  std::atomic<int64_t> m_checkedAt{0};
+  std::atomic<int> m_constraint{kNone};
+
+  qos_class_t qosClass() const {
+    switch (m_policy.qos) {
+    case QoS::Background:
+      return QOS_CLASS_BACKGROUND;
+    case QoS::Utility:
+      return QOS_CLASS_UTILITY;
+    case QoS::Default:
+      break;
+    }
+    return QOS_CLASS_DEFAULT;
+  }
+
+  static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  int constraint() {
+    int64_t now = nowMs();
+    int64_t checkedAt = m_checkedAt;
+    if (now - checkedAt >= 1000 &&
+        m_checkedAt.compare_exchange_strong(checkedAt, now)) {
+      if (m_policy.pauseOnBattery && onBatteryPower())
+        m_constraint = kBattery;
+      else if (m_policy.pauseOnThermal && underThermalPressure())
+        m_constraint = kThermal;
+      else
+        m_constraint = kNone;
+    }
+    return m_constraint;
+  }
+
+  void waitUntilUnconstrained() {
+    while (int why = constraint()) {
+      {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (!m_paused) {
+          m_paused = true;
+          m_pausedSince = nowMs();
+          LOG_DEBUG("Pausing scan: "
+                    << (why == kBattery ? "on battery" : "thermal pressure"));
+        }
+      }
+      // Seldom: a scan held for hours on battery shouldn't wake up the CPU
+      // every second
+      std::this_thread::sleep_for(kPausePoll);
+    }
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_paused) {
+      m_paused = false;
+      m_pausedMs += uint64_t(nowMs() - m_pausedSince);
+      LOG_DEBUG("Resuming scan");
+    }
+  }
+};
+
+// --- Volumes ---
+
+// Which mounted filesystems below a watch root are walked into. Network
+// shares cost a round trip per directory and per getxattr (and a stalled
+// one would hold a scan worker for minutes), read-only volumes such as
+// mounted disk images can't take an exclusion, and neither is backed up by
+// Time Machine.
+enum class VolumePolicy {
+  All,   // Everything, however slow
+  Local, // Local, writable volumes only
+  Root,  // Only the volume each root is on
+};
+
+static bool parseVolumePolicy(const std::string &name, VolumePolicy &policy) {
+  if (name == "all")
+    policy = VolumePolicy::All;
+  else if (name == "local")
+    policy = VolumePolicy::Local;
+  else if (name == "root")
+    policy = VolumePolicy::Root;
+  else
+    return false;
+  return true;
+}
+
+struct Volume {
+  std::string mountPoint;
+  std::string type; // "apfs", "smbfs", ...
+  dev_t device;
+  bool local;
+  bool readOnly;
+};
+
+// Reads the mount table with MNT_NOWAIT, which answers from the kernel's
+// cached statfs data and so never waits for a stalled share.
+static std::vector<Volume> mountedVolumes() {
+  std::vector<Volume> volumes;
+  struct statfs *mounts = nullptr;
+  int count = getmntinfo(&mounts, MNT_NOWAIT);
+  for (int i = 0; i < count; ++i) {
+    const struct statfs &fs = mounts[i];
+    volumes.push_back({fs.f_mntonname, fs.f_fstypename,
+                       dev_t(fs.f_fsid.val[0]), (fs.f_flags & MNT_LOCAL) != 0,
+                       (fs.f_flags & MNT_RDONLY) != 0});
+  }
+  return volumes;
+}
+
+// Why the policy skips a volume mounted below a root on rootDevice, or
+// null if it doesn't.
+static const char *volumeSkipReason(const Volume &volume, VolumePolicy policy,
+                                    dev_t rootDevice) {
+  switch (policy) {
+  case VolumePolicy::All:
+    return nullptr;
+  case VolumePolicy::Root:
+    return volume.device != rootDevice ? "other volume" : nullptr;
+  case VolumePolicy::Local:
+    if (!volume.local)
+      return "network filesystem";
+    if (volume.readOnly)
+      return "read-only";
+    return nullptr;
+  }
+  return nullptr;
+}
+
+// File provider trees look local, but listing them may download from the
+// cloud and their contents live there anyway. Relative to a home root.
+constexpr const char *kFileProviderDirs[] = {
+    "Library/Mobile Documents", // iCloud Drive
+    "Library/CloudStorage",     // Dropbox, OneDrive, Google Drive, ...
+};
+
+// --- Parallel Scanner ---
+
+// Subdirectories found by one visit, packed into one buffer that is reused
+// from directory to directory, so listing doesn't allocate per entry.
+class SubdirList {
+public:
+  void add(std::string_view dir, std::string_view name) {
+    m_bytes.append(dir);
+    if (dir.empty() || dir.back() != '/')
+      m_bytes += '/';
+    m_bytes.append(name);
+    m_ends.push_back(m_bytes.size());
+  }
+
+  // Keeps the buffers for the next directory, unless a huge one blew them
+  // up
+  void clear() {
+    if (m_bytes.capacity() > kKeepBytes) {
+      std::string().swap(m_bytes);
+      std::vector<size_t>().swap(m_ends);
+    }
+    m_bytes.clear();
+    m_ends.clear();
+  }
+
+  bool empty() const { return m_ends.empty(); }
+  size_t size() const { return m_ends.size(); }
+  std::string_view operator[](size_t i) const {
+    size_t begin = i ? m_ends[i - 1] : 0;
+    return std::string_view(m_bytes).substr(begin, m_ends[i] - begin);
+  }
+
+private:
+  static constexpr size_t kKeepBytes = 256 * 1024;
+
+  std::string m_bytes;
+  std::vector<size_t> m_ends;
+};
+
+// Backing store of the scan's work stacks: paths are packed into chunks
+// instead of one heap string each. A few empty chunks are kept for reuse;
+// bytes() counts them too, so it is what the work stacks really hold.
+class WorkChunkPool {
+public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  struct Chunk {
+    size_t capacity;
+    size_t used;
+    size_t live; // paths in it not taken yet
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  WorkChunkPool() = default;
+  WorkChunkPool(const WorkChunkPool &) = delete;
+  WorkChunkPool &operator=(const WorkChunkPool &) = delete;
+  ~WorkChunkPool() {
+    for (Chunk *chunk : m_spare)
+      std::free(chunk);
+  }
+
+  // A chunk with room for at least bytes; longer paths than kChunkSize get
+  // one of their own.
+  Chunk *acquire(size_t bytes) {
+    Chunk *chunk = nullptr;
+    if (bytes <= kChunkSize) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (!m_spare.empty()) {
+        chunk = m_spare.back();
+        m_spare.pop_back();
+      }
+    }
+    if (!chunk) {
+      size_t capacity = std::max(bytes, kChunkSize);
+      void *memory = std::malloc(sizeof(Chunk) + capacity);
+      if (!memory)
+        throw std::bad_alloc();
+      chunk = new (memory) Chunk{capacity, 0, 0};
+      size_t now = m_bytes += capacity;
+      size_t peak = m_peakBytes;
+      while (now > peak && !m_peakBytes.compare_exchange_weak(peak, now)) {
+      }
+    }
+    chunk->used = 0;
+    chunk->live = 0;
+    return chunk;
+  }
+
+  void release(Chunk *chunk) {
+    if (chunk->capacity == kChunkSize) {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (m_spare.size() < kMaxSpare) {
+        m_spare.push_back(chunk);
+        return;
+      }
+    }
+    m_bytes -= chunk->capacity;
+    std::free(chunk);
+  }
+
+  size_t bytes() const { return m_bytes; }
+  size_t peakBytes() const { return m_peakBytes; }
+
+private:
+  static constexpr size_t kMaxSpare = 8;
+
+  std::mutex m_lock;
+  std::vector<Chunk *> m_spare;
+  std::atomic<size_t> m_bytes{0};
+  std::atomic<size_t> m_peakBytes{0};
+};
+
+// Directories waiting to be visited by one worker: a deque of small
+// references into chunks from the pool. Taking the newest path rewinds the
+// chunk it came from, so a depth-first walk keeps reusing the same bytes,
+// and a chunk goes back to the pool as soon as its last path has been
+// taken from either end. Not thread safe; every call passes the pool the
+// chunks come from.
+class WorkStack {
+public:
+  bool empty() const { return m_items.empty(); }
+
+  void push(WorkChunkPool &pool, std::string_view path) {
+    if (!m_top || m_top->capacity - m_top->used < path.size()) {
+      if (m_top && m_top->live == 0)
+        pool.release(m_top);
+      m_top = pool.acquire(path.size()); // the old one goes when emptied
+    }
+    std::memcpy(m_top->data() + m_top->used, path.data(), path.size());
+    m_items.push_back({m_top, m_top->used, path.size()});
+    m_top->used += path.size();
+    ++m_top->live;
+  }
+
+  // Newest path, for the owner
+  bool popBack(WorkChunkPool &pool, std::string &out) {
+    if (m_items.empty())
+      return false;
+    Item item = m_items.back();
+    m_items.pop_back();
+    out.assign(item.chunk->data() + item.offset, item.length);
+    if (item.chunk == m_top && item.offset + item.length == m_top->used)
+      m_top->used = item.offset;
+    take(pool, item.chunk);
+    return true;
+  }
+
+  // Oldest path, the largest untouched subtree, for thieves
+  bool popFront(WorkChunkPool &pool, std::string &out) {
+    if (m_items.empty())
+      return false;
+    Item item = m_items.front();
+    m_items.pop_front();
+    out.assign(item.chunk->data() + item.offset, item.length);
+    take(pool, item.chunk);
+    return true;
+  }
+
+  // Hands every chunk back, taken or not.
+  void clear(WorkChunkPool &pool) {
+    for (const Item &item : m_items)
+      take(pool, item.chunk);
+    m_items.clear();
+    if (m_top)
+      pool.release(m_top);
+    m_top = nullptr;
+  }
+
+private:
+  struct Item {
+    WorkChunkPool::Chunk *chunk;
+    size_t offset;
+    size_t length;
+  };
+
+  void take(WorkChunkPool &pool, WorkChunkPool::Chunk *chunk) {
+    if (--chunk->live != 0)
+      return;
+    if (chunk == m_top)
+      m_top->used = 0; // Still the one being filled
+    else
+      pool.release(chunk);
+  }
+
+  std::deque<Item> m_items;
+  WorkChunkPool::Chunk *m_top = nullptr; // chunk new paths go into
+};
+
+// Bounded pool of workers that share a directory tree. Each worker pushes
+// the subdirectories it finds onto its own work stack and pops the newest
+// (depth-first, cache friendly); idle workers steal the oldest from other
+// stacks, which hands them the largest untouched subtrees.
+//
+// There is no recursion, so depth costs nothing but the paths on the
+// stacks. Each worker's stack holds at most the siblings along its current
+// path; what multiplies that is the number of workers walking. Past the
+// memory cap nothing more is queued: a worker walks the listing it just
+// made depth-first in place, holding one listing per level of its walk,
+// and idle workers stop stealing, so no new walk starts until the stacks
+// have drained below the cap.
+class WorkStealingScanner {
+public:
+  // Visits one directory and appends the subdirectories to descend into.
+  using VisitFn = std::function<void(const fs::path &dir, SubdirList &subdirs)>;
+
+  WorkStealingScanner(unsigned workers, VisitFn visit,
+                      const ScanThrottle *throttle = nullptr,
+                      size_t memoryCap = 0)
+      : m_visit(std::move(visit)), m_queues(workers ? workers : 1),
+        m_throttle(throttle), m_memoryCap(memoryCap) {}
+
+  ~WorkStealingScanner() {
+    for (auto &q : m_queues)
+      q.items.clear(m_pool);
+  }
+
+  // Blocks until the whole trees below all roots have been visited. Roots
+  // are dealt out round-robin, so each one starts on its own worker.
+  void run(const std::vector<fs::path> &roots) {
+    m_pending = roots.size();
+    for (size_t i = 0; i < roots.size(); ++i)
+      m_queues[i % m_queues.size()].items.push(m_pool, roots[i].native());
+
+    std::vector<std::thread> threads;
+    threads.reserve(m_queues.size());
+    for (size_t i = 0; i < m_queues.size(); ++i)
+      threads.emplace_back([this, i] { workerLoop(i); });
+    for (auto &t : threads)
+      t.join();
+  }
+
+  size_t workerCount() const { return m_queues.size(); }
+  size_t directoriesVisited() const { return m_visited; }
+  // Most memory the work stacks held at once
+  size_t peakStackBytes() const { return m_pool.peakBytes(); }
+  // Times an idle worker held back because of the memory cap, once per
+  // idle spell
+  size_t cappedSteals() const { return m_cappedSteals; }
+  // Directories walked in place instead of queued, see walkInPlace()
+  size_t inPlaceDirectories() const { return m_inPlace; }
+
+private:
+  struct WorkerQueue {
+    std::mutex lock;
+    WorkStack items;
+  };
+
+  VisitFn m_visit;
+  WorkChunkPool m_pool;
+  std::vector<WorkerQueue> m_queues;
+  const ScanThrottle *m_throttle;
+  size_t m_memoryCap; // bytes, 0 = unlimited
+  // Directories queued or in progress. The scan is done when it drops to 0.
+  std::atomic<size_t> m_pending{0};
+  std::atomic<size_t> m_visited{0};
+  std::atomic<size_t> m_cappedSteals{0};
+  std::atomic<size_t> m_inPlace{0};
+  std::atomic<unsigned> m_idleWorkers{0};
+  std::mutex m_idleLock;
+  std::condition_variable m_idleCv;
+
+  bool popLocal(size_t self, std::string &out) {
+    WorkerQueue &q = m_queues[self];
+    std::lock_guard<std::mutex> guard(q.lock);
+    return q.items.popBack(m_pool, out);
+  }
+
+  bool overCap() const { return m_memoryCap && m_pool.bytes() > m_memoryCap; }
+
+  // capped tells whether the memory cap held the steal back.
+  bool steal(size_t self, std::string &out, bool &capped) {
+    capped = overCap();
+    if (capped)
+      return false;
+    for (size_t n = 1; n < m_queues.size(); ++n) {
+      WorkerQueue &q = m_queues[(self + n) % m_queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (q.items.popFront(m_pool, out))
+        return true;
+    }
+    return false;
+  }
+
+  void workerLoop(size_t self) {
+    if (m_throttle)
+      m_throttle->enterWorker();
+    SubdirList subdirs;
+    std::string next;
+    fs::path dir;
+    bool heldBack = false; // this idle spell was already counted
+    while (m_pending > 0) {
+      bool capped = false;
+      if (!popLocal(self, next) && !steal(self, next, capped)) {
+        if (capped && !heldBack)
+          ++m_cappedSteals;
+        heldBack = capped;
+        // Nothing to do right now; somebody else may still produce work
+        std::unique_lock<std::mutex> idle(m_idleLock);
+        ++m_idleWorkers;
+        m_idleCv.wait_for(idle, std::chrono::milliseconds(5));
+        --m_idleWorkers;
+        continue;
+      }
+      heldBack = false;
+
+      dir = next;
+      visit(dir, subdirs);
+      if (!subdirs.empty()) {
+        if (overCap())
+          walkInPlace(self, subdirs);
+        else
+          queue(self, subdirs);
+      }
+
+      if (--m_pending == 0)
+        m_idleCv.notify_all();
+    }
+  }
+
+  void visit(const fs::path &dir, SubdirList &subdirs) {
+    subdirs.clear();
+    try {
+      m_visit(dir, subdirs);
+    } catch (const std::exception &e) {
+      LOG_WARN("Scan of " << dir.string() << " failed: " << e.what());
+      subdirs.clear();
+    }
+    ++m_visited;
+  }
+
+  void queue(size_t self, const SubdirList &subdirs) {
+    m_pending += subdirs.size();
+    {
+      WorkerQueue &q = m_queues[self];
+      std::lock_guard<std::mutex> guard(q.lock);
+      for (size_t i = 0; i < subdirs.size(); ++i)
+        q.items.push(m_pool, subdirs[i]);
+    }
+    // Only pay for a wakeup when somebody is actually waiting for work
+    if (m_idleWorkers > 0)
+      m_idleCv.notify_all();
+  }
+
+  // Walks the trees below subdirs depth-first on this worker, one listing
+  // per level, instead of queueing them; the directory the listing came
+  // from still counts as pending meanwhile. Listings made once the stacks
+  // are below the cap again are queued as usual, for others to steal.
+  void walkInPlace(size_t self, SubdirList &subdirs) {
+    struct Level {
+      SubdirList dirs;
+      size_t next = 0;
+    };
+    std::vector<Level> levels(1);
+    std::swap(levels[0].dirs, subdirs);
+    SubdirList found;
+    fs::path dir;
+    while (!levels.empty()) {
+      Level &level = levels.back();
+      if (level.next == level.dirs.size()) {
+        levels.pop_back();
+        continue;
+      }
+      dir = level.dirs[level.next++];
+      ++m_inPlace;
+      visit(dir, found);
+      if (found.empty())
+        continue;
+      if (!overCap()) {
+        queue(self, found);
+        continue;
+      }
+      levels.emplace_back();
+      std::swap(levels.back().dirs, found);
+    }
+  }
+};
+
+// --- Path Trie ---
+
+// Component-wise radix trie over absolute paths. Each edge is labelled with
+// one or more path components ("Users/me/Library"), and nodes carry marks
+// that apply to the node's path and everything below it. Lookups walk
+// string_view components, so classifying a path never allocates and costs
+// O(path depth) regardless of how many paths are stored.
+//
+// Not thread-safe on its own; see PathClassifier.
+class PathTrie {
+public:
+  using Marks = uint8_t;
+  static constexpr Marks kIgnored = 1 << 0;  // ignore rule from the config
+  static constexpr Marks kExcluded = 1 << 1; // known backup-excluded dir
+  static constexpr Marks kPending = 1 << 2;  // candidate awaiting evaluation
+  static constexpr Marks kSkippedVolume = 1 << 3; // see VolumePolicy
+  static constexpr Marks kExcluding = 1 << 4; // in the exclusion queue
+
+  // Adds marks to path. Returns the marks that were not set before.
+  Marks mark(std::string_view path, Marks marks) {
+    Node *node = &m_root;
+    size_t pos = 0;
+    for (;;) {
+      size_t start = pos;
+      std::string_view comp = nextComponent(path, pos);
+      if (comp.empty()) {
+        Marks added = marks & ~node->marks;
+        node->marks |= marks;
+        return added;
+      }
+
+      auto it = findChild(*node, comp);
+      if (it == node->children.end() || firstComponent((*it)->label) != comp) {
+        auto child = std::make_unique<Node>();
+        child->label = joinComponents(path, start);
+        child->marks = marks;
+        node->children.insert(it, std::move(child));
+        return marks;
+      }
+
+      LabelMatch m = matchLabel((*it)->label, path, start);
+      if (!m.full)
+        splitChild(*it, m.labelLength);
+      node = it->get();
+      pos = m.pathPos;
+    }
+  }
+
+  // OR of the marks on path and all of its ancestors.
+  Marks lookup(std::string_view path) const {
+    const Node *node = &m_root;
+    Marks marks = node->marks;
+    size_t pos = 0;
+    for (;;) {
+      size_t start = pos;
+      std::string_view comp = nextComponent(path, pos);
+      if (comp.empty())
+        return marks;
+
+      auto it = findChild(*node, comp);
+      if (it == node->children.end() || firstComponent((*it)->label) != comp)
+        return marks;
+      LabelMatch m = matchLabel((*it)->label, path, start);
+      if (!m.full)
+        return marks; // Stored paths below here are deeper than path
+      node = it->get();
+      marks |= node->marks;
+      pos = m.pathPos;
+    }
+  }
+
+  // Clears marks from path and everything below it. Returns how many nodes
+  // lost one of the marks.
+  size_t clear(std::string_view path, Marks marks) {
+    return clearBelow(m_root, path, 0, marks);
+  }
+
+  size_t clearAll(Marks marks) { return clearSubtree(m_root, marks); }
+
+  // Appends the name of every child of path that has one of marks on it
+  // or somewhere below it.
+  void markedChildren(std::string_view path, Marks marks,
+                      std::vector<std::string> &out) const {
+    const Node *node = &m_root;
+    size_t pos = 0;
+    for (;;) {
+      size_t start = pos;
+      std::string_view comp = nextComponent(path, pos);
+      if (comp.empty())
+        break;
+      auto it = findChild(*node, comp);
+      if (it == node->children.end() || firstComponent((*it)->label) != comp)
+        return;
+      LabelMatch m = matchLabel((*it)->label, path, start);
+      if (m.pathEnded) {
+        // path ends inside this label: its one child is the next component
+        std::string_view rest =
+            std::string_view((*it)->label).substr(m.labelLength + 1);
+        if (hasMarks(**it, marks))
+          out.emplace_back(firstComponent(rest));
+        return;
+      }
+      if (!m.full)
+        return;
+      node = it->get();
+      pos = m.pathPos;
+    }
+    for (const auto &child : node->children) {
+      if (hasMarks(*child, marks))
+        out.emplace_back(firstComponent(child->label));
+    }
+  }
+
+private:
+  struct Node {
+    std::string label; // components joined by '/', no leading/trailing '/'
+    Marks marks = 0;
+    // Sorted by the first component of their label
+    std::vector<std::unique_ptr<Node>> children;
+  };
+  using ChildIt = std::vector<std::unique_ptr<Node>>::iterator;
+  using ConstChildIt = std::vector<std::unique_ptr<Node>>::const_iterator;
+
+  struct LabelMatch {
+    bool full;          // every component of the label matched
+    bool pathEnded;     // path ran out first (it lies inside the label)
+    size_t labelLength; // chars of the label covered by matched components
+    size_t pathPos;     // position in path after the matched components
+  };
+
+  Node m_root;
+
+  static std::string_view nextComponent(std::string_view path, size_t &pos) {
+    while (pos < path.size() && path[pos] == '/')
+      ++pos;
+    size_t end = path.find('/', pos);
+    if (end == std::string_view::npos)
+      end = path.size();
+    std::string_view comp = path.substr(pos, end - pos);
+    pos = end;
+    return comp;
+  }
+
+  static std::string_view firstComponent(std::string_view label) {
+    return label.substr(0, label.find('/'));
+  }
+
+  static std::string joinComponents(std::string_view path, size_t pos) {
+    std::string joined;
+    for (std::string_view comp = nextComponent(path, pos); !comp.empty();
+         comp = nextComponent(path, pos)) {
+      if (!joined.empty())
+        joined += '/';
+      joined.append(comp.data(), comp.size());
+    }
+    return joined;
+  }
+
+  static LabelMatch matchLabel(std::string_view label, std::string_view path,
+                               size_t pos) {
+    size_t labelPos = 0;
+    size_t matched = 0;
+    for (;;) {
+      std::string_view want = nextComponent(label, labelPos);
+      if (want.empty())
+        return {true, false, matched, pos};
+      size_t next = pos;
+      std::string_view have = nextComponent(path, next);
+      if (have.empty())
+        return {false, true, matched, pos};
+      if (have != want)
+        return {false, false, matched, pos};
+      matched = labelPos;
+      pos = next;
+    }
+  }
+
+  template <typename NodeT, typename It>
+  static It findChildImpl(NodeT &node, std::string_view comp) {
+    return std::lower_bound(node.children.begin(), node.children.end(), comp,
+                            [](const std::unique_ptr<Node> &child,
+                               std::string_view key) {
+                              return firstComponent(child->label) < key;
+                            });
+  }
+  static ChildIt findChild(Node &node, std::string_view comp) {
+    return findChildImpl<Node, ChildIt>(node, comp);
+  }
+  static ConstChildIt findChild(const Node &node, std::string_view comp) {
+    return findChildImpl<const Node, ConstChildIt>(node, comp);
+  }
+
+  // Turns child "a/b/c" into "a/b" -> "c" at the given label offset.
+  static void splitChild(std::unique_ptr<Node> &slot, size_t labelLength) {
+    auto upper = std::make_unique<Node>();
+    upper->label = slot->label.substr(0, labelLength);
+    slot->label.erase(0, labelLength + 1);
+    upper->children.push_back(std::move(slot));
+    slot = std::move(upper);
+  }
+
+  static size_t clearBelow(Node &node, std::string_view path, size_t pos,
+                           Marks marks) {
+    size_t start = pos;
+    std::string_view comp = nextComponent(path, pos);
+    if (comp.empty())
+      return clearSubtree(node, marks);
+
+    auto it = findChild(node, comp);
+    if (it == node.children.end() || firstComponent((*it)->label) != comp)
+      return 0;
+    LabelMatch m = matchLabel((*it)->label, path, start);
+    size_t cleared;
+    if (m.full)
+      cleared = clearBelow(**it, path, m.pathPos, marks);
+    else if (m.pathEnded)
+      cleared = clearSubtree(**it, marks); // Whole child lies below path
+    else
+      return 0;
+
+    if ((*it)->marks == 0 && (*it)->children.empty())
+      node.children.erase(it);
+    return cleared;
+  }
+
+  static bool hasMarks(const Node &node, Marks marks) {
+    if (node.marks & marks)
+      return true;
+    for (const auto &child : node.children) {
+      if (hasMarks(*child, marks))
+        return true;
+    }
+    return false;
+  }
+
+  static size_t clearSubtree(Node &node, Marks marks) {
+    size_t cleared = (node.marks & marks) ? 1 : 0;
+    node.marks &= ~marks;
+    for (auto it = node.children.begin(); it != node.children.end();) {
+      cleared += clearSubtree(**it, marks);
+      if ((*it)->marks == 0 && (*it)->children.empty())
+        it = node.children.erase(it);
+      else
+        ++it;
+    }
+    return cleared;
+  }
+};
+
+// Per-path state shared by the event path, the scanner and the exclusion
+// queue. Ignore rules and the excluded-prefix cache live in one trie, so a
+// single walk tells whether a path is ignored or inside a known excluded
+// directory.
+//
+// Excluded marks are only a cache: the xattr stays the source of truth and
+// a miss falls back to probing the filesystem.
+class PathClassifier {
+public:
+  explicit PathClassifier(size_t excludedCapacity)
+      : m_excludedCapacity(excludedCapacity) {}
+
+  // Replaces every ignore rule at once, so no lookup sees a partial set.
+  void setIgnored(const std::vector<std::string> &paths) {
+    replaceMarks(paths, PathTrie::kIgnored);
+  }
+
+  // Mount points the volume policy keeps us out of, replaced at once too.
+  void setSkippedVolumes(const std::vector<std::string> &paths) {
+    replaceMarks(paths, PathTrie::kSkippedVolume);
+  }
+
+  void markExcluded(std::string_view dir) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    // Simplest possible bound: start over. Entries come back from the next
+    // xattr hit, and real homes have far fewer excluded dirs than this.
+    if (m_excludedCount >= m_excludedCapacity) {
+      m_trie.clearAll(PathTrie::kExcluded);
+      m_excludedCount = 0;
+    }
+    if (m_trie.mark(dir, PathTrie::kExcluded))
+      ++m_excludedCount;
+  }
+
+  // Directories handed to the exclusion queue, until it is done with them.
+  // Nothing below one needs evaluating: it is about to be excluded with it.
+  void markExcluding(std::string_view dir) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_trie.mark(dir, PathTrie::kExcluding);
+  }
+
+  void finishExcluding(std::string_view dir) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_trie.clear(dir, PathTrie::kExcluding);
+  }
+
+  // Forget every cached exclusion, e.g. to free memory.
+  void clearExcluded() {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_trie.clearAll(PathTrie::kExcluded);
+    m_excludedCount = 0;
+  }
+
+  // Forget cached exclusions at or below dir (it was removed or renamed).
+  void invalidate(std::string_view dir) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_excludedCount -= m_trie.clear(dir, PathTrie::kExcluded);
+  }
+
+  PathTrie::Marks classify(std::string_view path) const {
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    return m_trie.lookup(path);
+  }
+
+  // Names of the children of dir with a cached exclusion at or below them.
+  void excludedChildren(std::string_view dir,
+                        std::vector<std::string> &out) const {
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    m_trie.markedChildren(dir, PathTrie::kExcluded, out);
+  }
+
+private:
+  mutable std::shared_mutex m_lock;
+  PathTrie m_trie;
+  size_t m_excludedCount = 0;
+  size_t m_excludedCapacity;
+
+  void replaceMarks(const std::vector<std::string> &paths,
+                    PathTrie::Marks marks) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_trie.clearAll(marks);
+    for (const auto &path : paths)
+      m_trie.mark(path, marks);
+  }
+};
+
+// --- Persistent Exclusion Index ---
+
+// Excluded directories known from earlier runs, so a warm start answers
+// "is this inside an excluded directory?" without walking xattrs again.
+//
+// On disk it is a sorted string table, mapped read-only and searched in
+// place: a header, count + 1 offsets into the string blob, then the blob.
+// Changes since the last save live in memory (added paths, removed
+// subtrees); save() merges them into a new file and swaps the mapping.
+//
+// The file is only as good as the checkpoint it was saved with: its event
+// id must not be newer than the checkpoint's, and every removal since then
+// has to be replayed from FSEvents. Callers only load() while replaying.
+class ExclusionIndex {
+public:
+  ExclusionIndex() = default;
+  ExclusionIndex(const ExclusionIndex &) = delete;
+  ExclusionIndex &operator=(const ExclusionIndex &) = delete;
+  ~ExclusionIndex() { unmap(); }
+
+  // Maps the index at path if it is consistent with a checkpoint at
+  // eventId. Returns the number of entries, 0 if there is none to use.
+  size_t load(const std::string &path, uint64_t eventId) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    return mapFile(path, eventId);
+  }
+
+  // Forgets everything, including the mapped file; used when the index
+  // can't be trusted anymore (e.g. before a full scan).
+  void reset() {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    unmap();
+    m_added.clear();
+    m_removed.clearAll(PathTrie::kExcluded);
+    m_dirty = true;
+  }
+
+  void add(std::string_view dir) {
+    {
+      std::shared_lock<std::shared_mutex> guard(m_lock);
+      if (coveringLength(dir) == dir.size())
+        return; // Already known, keep the delta small on warm starts
+    }
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    m_added.emplace(dir);
+    m_dirty = true;
+  }
+
+  // dir and everything below it was removed or renamed. Only marks the
+  // index dirty if it actually had something there: removals are common,
+  // and every dirty checkpoint rewrites the whole file.
+  void invalidate(std::string_view dir) {
+    std::string below = subtreePrefix(dir);
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    auto exact = m_added.find(dir);
+    if (exact != m_added.end())
+      m_added.erase(exact);
+    auto it = m_added.lower_bound(below);
+    while (it != m_added.end() &&
+           it->compare(0, below.size(), below) == 0)
+      it = m_added.erase(it);
+
+    if (m_removed.lookup(dir) & PathTrie::kExcluded)
+      return; // An ancestor was dropped already
+    size_t i = baseLowerBound(dir);
+    bool inBase = i < m_count && entryAt(i) == dir;
+    if (!inBase) {
+      i = baseLowerBound(below);
+      inBase = i < m_count && entryAt(i).compare(0, below.size(), below) == 0;
+    }
+    if (!inBase)
+      return;
+    m_removed.clear(dir, PathTrie::kExcluded); // Covered by dir from now on
+    m_removed.mark(dir, PathTrie::kExcluded);
+    m_dirty = true;
+  }
+
+  // Length of the nearest excluded ancestor of path (or path itself), 0 if
+  // there is none. Allocation free; no syscalls.
+  size_t covering(std::string_view path) const {
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    return coveringLength(path);
+  }
+
+  // Appends the names of the children of dir with an entry at or below
+  // them. Once a child is found, the rest of its subtree is skipped with
+  // one search, so this costs a search per child rather than a step per
+  // exclusion below dir.
+  void excludedChildren(std::string_view dir,
+                        std::vector<std::string> &out) const {
+    std::shared_lock<std::shared_mutex> guard(m_lock);
+    std::string prefix = subtreePrefix(dir);
+    // Entries below "name/" sort as one run, ending before "name0" ('0'
+    // follows '/'). Siblings like "name-x" sort between "name" and that
+    // run, so only entries that are below a child jump past it.
+    std::string skip;
+    auto child = [&](std::string_view entry, bool &below) {
+      std::string_view name = entry.substr(prefix.size());
+      size_t slash = name.find('/');
+      below = slash != std::string_view::npos;
+      name = name.substr(0, slash);
+      skip.assign(prefix).append(name) += char('/' + 1);
+      return name;
+    };
+    size_t first = out.size();
+    auto it = m_added.lower_bound(prefix);
+    while (it != m_added.end() && it->compare(0, prefix.size(), prefix) == 0) {
+      bool below;
+      std::string_view name = child(*it, below);
+      if (name.empty()) {
+        ++it;
+        continue;
+      }
+      out.emplace_back(name);
+      it = below ? m_added.lower_bound(skip) : std::next(it);
+    }
+    size_t i = baseLowerBound(prefix);
+    while (i < m_count) {
+      std::string_view entry = entryAt(i);
+      if (entry.compare(0, prefix.size(), prefix) != 0)
+        break;
+      bool below;
+      std::string_view name = child(entry, below);
+      bool removed = m_removed.lookup(entry) & PathTrie::kExcluded;
+      if (!removed && !name.empty())
+        out.emplace_back(name);
+      if (!below || name.empty()) {
+        ++i;
+        continue;
+      }
+      // Past a removed entry the rest of the subtree may still count,
+      // unless the child itself was removed
+      std::string_view childPath(skip.data(), skip.size() - 1);
+      if (removed && !(m_removed.lookup(childPath) & PathTrie::kExcluded)) {
+        ++i;
+        continue;
+      }
+      i = baseLowerBound(skip);
+    }
+    std::sort(out.begin() + first, out.end());
+    out.erase(std::unique(out.begin() + first, out.end()), out.end());
+  }
+
+  // Writes base + changes to path (write, fsync, rename) and maps the new
+  // file. Does nothing if there were no changes since the last save.
+  bool save(const std::string &path, uint64_t eventId) {
+    std::unique_lock<std::shared_mutex> guard(m_lock);
+    if (!m_dirty)
+      return true;
+
+    std::vector<std::string_view> merged;
+    merged.reserve(m_count + m_added.size());
+    auto added = m_added.begin();
+    for (size_t i = 0; i < m_count; ++i) {
+      std::string_view entry = entryAt(i);
+      if (m_removed.lookup(entry) & PathTrie::kExcluded)
+        continue;
+      while (added != m_added.end() && std::string_view(*added) < entry)
+        merged.push_back(*added++);
+      if (added != m_added.end() && std::string_view(*added) == entry)
+        ++added;
+      merged.push_back(entry);
+    }
+    for (; added != m_added.end(); ++added)
+      merged.push_back(*added);
+
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.version = kVersion;
+    header.count = static_cast<uint32_t>(merged.size());
+    header.eventId = eventId;
+    std::vector<uint32_t> offsets;
+    offsets.reserve(merged.size() + 1);
+    uint64_t bytes = 0;
+    for (std::string_view entry : merged) {
+      offsets.push_back(static_cast<uint32_t>(bytes));
+      bytes += entry.size();
+    }
+    offsets.push_back(static_cast<uint32_t>(bytes));
+    header.stringBytes = bytes;
+
+    std::string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+      return false;
+    bool ok = writeFully(fd, &header, sizeof(header)) &&
+              writeFully(fd, offsets.data(), offsets.size() * 4);
+    for (size_t i = 0; ok && i < merged.size(); ++i)
+      ok = writeFully(fd, merged[i].data(), merged[i].size());
+    // The rename must not become visible before the data
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+      unlink(tmpPath.c_str());
+      return false;
+    }
+
+    // merged points into the old mapping and m_added; done with it now. If
+    // the new file can't be mapped, lookups fall back to xattrs.
+    m_added.clear();
+    m_removed.clearAll(PathTrie::kExcluded);
+    m_dirty = false;
+    return mapFile(path, eventId) == header.count;
+  }
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t eventId; // Checkpoint this index was saved with
+    uint64_t stringBytes;
+  };
+  static constexpr char kMagic[8] = {'A', 'S', 'I', 'M', 'O', 'V', 'I', 'X'};
+  static constexpr uint32_t kVersion = 1;
+
+  mutable std::shared_mutex m_lock;
+  const char *m_map = nullptr;
+  size_t m_mapSize = 0;
+  size_t m_count = 0;
+  const uint32_t *m_offsets = nullptr;
+  const char *m_strings = nullptr;
+  std::set<std::string, std::less<>> m_added;
+  PathTrie m_removed; // kExcluded marks subtrees dropped from the base
+  bool m_dirty = false;
+
+  size_t mapFile(const std::string &path, uint64_t eventId) {
+    unmap();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return 0;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header))
+      base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+      return 0;
+
+    m_map = static_cast<const char *>(base);
+    m_mapSize = st.st_size;
+    const Header &header = *reinterpret_cast<const Header *>(m_map);
+    size_t tableEnd = sizeof(Header) + (size_t(header.count) + 1) * 4;
+    bool valid = std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                 header.version == kVersion && header.eventId <= eventId &&
+                 tableEnd <= m_mapSize &&
+                 header.stringBytes == m_mapSize - tableEnd;
+    if (!valid) {
+      unmap();
+      return 0;
+    }
+    m_count = header.count;
+    m_offsets = reinterpret_cast<const uint32_t *>(m_map + sizeof(Header));
+    m_strings = m_map + tableEnd;
+    return m_count;
+  }
+
+  void unmap() {
+    if (m_map)
+      munmap(const_cast<char *>(m_map), m_mapSize);
+    m_map = nullptr;
+    m_mapSize = 0;
+    m_count = 0;
+  }
+
+  // Entries of a damaged file come out empty rather than out of bounds
+  std::string_view entryAt(size_t i) const {
+    uint32_t begin = m_offsets[i], end = m_offsets[i + 1];
+    size_t bytes = m_mapSize - (m_strings - m_map);
+    if (begin > end || end > bytes)
+      return std::string_view();
+    return std::string_view(m_strings + begin, end - begin);
+  }
+
+  // First entry of the base that is not less than key
+  size_t baseLowerBound(std::string_view key) const {
+    size_t lo = 0, hi = m_count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (entryAt(mid) < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  bool baseContains(std::string_view path) const {
+    size_t i = baseLowerBound(path);
+    return i < m_count && entryAt(i) == path &&
+           !(m_removed.lookup(path) & PathTrie::kExcluded);
+  }
+
+  // "dir/": what every path strictly below dir starts with
+  static std::string subtreePrefix(std::string_view dir) {
+    std::string prefix(dir);
+    if (prefix.empty() || prefix.back() != '/')
+      prefix += '/';
+    return prefix;
+  }
+
+  size_t coveringLength(std::string_view path) const {
+    if (m_count == 0 && m_added.empty())
+      return 0;
+    for (size_t length = path.size(); length > 1;) {
+      std::string_view prefix = path.substr(0, length);
+      if (m_added.count(prefix) || baseContains(prefix))
+        return length;
+      size_t slash = path.rfind('/', length - 1);
+      if (slash == std::string_view::npos || slash == 0)
+        break;
+      length = slash;
+    }
+    return 0;
+  }
+};
+
+// --- Negative Probe Cache ---
+
+// Paths recently probed and found missing, least recently used out first.
+// Not thread-safe; each event shard owns one. Only sentinel and target
+// paths go in, and since those names always pass the event filter, their
+// create and rename events can evict them reliably.
+class MissingPathCache {
+public:
+  explicit MissingPathCache(size_t capacity) : m_capacity(capacity) {}
+
+  bool contains(const std::string &path) {
+    auto it = m_index.find(std::string_view(path));
+    if (it == m_index.end())
+      return false;
+    m_order.splice(m_order.begin(), m_order, it->second);
+    return true;
+  }
+
+  void insert(const std::string &path) {
+    if (contains(path))
+      return;
+    if (m_index.size() >= m_capacity) {
+      m_index.erase(std::string_view(m_order.back()));
+      m_order.pop_back();
+    }
+    m_order.push_front(path);
+    m_index.emplace(std::string_view(m_order.front()), m_order.begin());
+  }
+
+  void erase(std::string_view path) {
+    auto it = m_index.find(path);
+    if (it == m_index.end())
+      return;
+    auto node = it->second;
+    m_index.erase(it);
+    m_order.erase(node);
+  }
+
+  // Drops dir and everything below it (it was removed or renamed).
+  void eraseBelow(std::string_view dir) {
+    auto it = m_index.lower_bound(dir);
+    while (it != m_index.end() && it->first.compare(0, dir.size(), dir) == 0) {
+      std::string_view path = it->first;
+      if (path.size() != dir.size() && path[dir.size()] != '/') {
+        ++it; // A sibling like "dir2"
+        continue;
+      }
+      auto node = it->second;
+      it = m_index.erase(it);
+      m_order.erase(node);
+    }
+  }
+
+  void clear() {
+    m_index.clear();
+    m_order.clear();
+  }
+
+private:
+  size_t m_capacity;
+  std::list<std::string> m_order; // Most recently used first
+  // Keys point into m_order, whose nodes never move
+  std::map<std::string_view, std::list<std::string>::iterator> m_index;
+};
+
+// --- Exclusion Backends ---
+
+class ExclusionBackend {
+public:
+  virtual ~ExclusionBackend() = default;
+  virtual const char *name() const = 0;
+  // False for backends that only pretend; nothing on disk may change then.
+  virtual bool modifiesFilesystem() const { return true; }
+  // Sets results[i] to whether paths[i] is now excluded from backups.
+  virtual void exclude(const std::vector<std::string> &paths,
+                       std::vector<bool> &results) = 0;
+};
+
+// In-process sticky exclusion through CoreServices. Writes the same
+// com_apple_backup_excludeItem xattr as 'tmutil addexclusion' without
+// starting a process.
+class NativeExclusionBackend : public ExclusionBackend {
+public:
+  const char *name() const override { return "native"; }
+
+  void exclude(const std::vector<std::string> &paths,
+               std::vector<bool> &results) override {
+    results.assign(paths.size(), false);
+    for (size_t i = 0; i < paths.size(); ++i) {
+      CFURLRef url = CFURLCreateFromFileSystemRepresentation(
+          NULL, reinterpret_cast<const UInt8 *>(paths[i].c_str()),
+          paths[i].size(), true);
+      if (!url)
+        continue;
+      results[i] = (CSBackupSetItemExcluded(url, true, false) == noErr);
+      CFRelease(url);
+    }
+  }
+};
+
+// Shells out to /usr/bin/tmutil, many paths per invocation.
+class TmutilExclusionBackend : public ExclusionBackend {
+public:
+  const char *name() const override { return "tmutil"; }
+
+  void exclude(const std::vector<std::string> &paths,
+               std::vector<bool> &results) override {
+    for (size_t i = 0; i < paths.size(); i += kMaxPathsPerInvocation)
+      runTmutil(paths, i, std::min(paths.size(), i + kMaxPathsPerInvocation));
+
+    // tmutil only reports a single exit status, so each path's result is
+    // read back from its xattr
+    results.assign(paths.size(), false);
+    for (size_t i = 0; i < paths.size(); ++i)
+      results[i] = isExcludedFast(paths[i].c_str());
+  }
+
+private:
+  // Keeps argv well below ARG_MAX even for deep paths
+  static constexpr size_t kMaxPathsPerInvocation = 64;
+
+  static void runTmutil(const std::vector<std::string> &paths, size_t begin,
+                        size_t end) {
+    std::vector<char *> argv;
+    argv.reserve(end - begin + 3);
+    argv.push_back(const_cast<char *>("tmutil"));
+    argv.push_back(const_cast<char *>("addexclusion"));
+    for (size_t i = begin; i < end; ++i)
+      argv.push_back(const_cast<char *>(paths[i].c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    if (posix_spawn(&pid, "/usr/bin/tmutil", nullptr, nullptr, argv.data(),
+                    environ) != 0) {
+      LOG_ERROR("Failed to spawn tmutil");
+      return;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+  }
+};
+
+// Excludes nothing and reports success, so everything upstream behaves as
+// if it had. Used by --bench.
+class DryRunExclusionBackend : public ExclusionBackend {
+public:
+  const char *name() const override { return "none"; }
+  bool modifiesFilesystem() const override { return false; }
+
+  void exclude(const std::vector<std::string> &paths,
+               std::vector<bool> &results) override {
+    results.assign(paths.size(), true);
+  }
+};
+
+// Returns nullptr for an unknown backend name.
+static std::unique_ptr<ExclusionBackend>
+makeExclusionBackend(const std::string &name) {
+  if (name == "native")
+    return std::make_unique<NativeExclusionBackend>();
+  if (name == "tmutil")
+    return std::make_unique<TmutilExclusionBackend>();
+  if (name == "none")
+    return std::make_unique<DryRunExclusionBackend>();
+  return nullptr;
+}
+
+// --- Exclusion Pipeline ---
+
+// Queue of directories waiting to be excluded, drained by its own serial
+// queue so that event processing never waits for the backend. Paths that
+// pile up while a batch is in flight are coalesced into the next one.
+class ExclusionQueue {
+public:
+  explicit ExclusionQueue(std::unique_ptr<ExclusionBackend> backend)
+      : m_backend(std::move(backend)),
+        m_queue(dispatch_queue_create("com.asimov.exclusions", NULL)) {}
+
+  const char *backendName() const { return m_backend->name(); }
+  bool modifiesFilesystem() const { return m_backend->modifiesFilesystem(); }
+
+  struct Stats {
+    std::atomic<uint64_t> requested{0}; // enqueue() calls
+    std::atomic<uint64_t> queued{0};    // the ones that weren't waiting yet
+    std::atomic<uint64_t> alreadyExcluded{0};
+    std::atomic<uint64_t> excluded{0};
+    std::atomic<uint64_t> failed{0};
+    LatencyHistogram backend; // one ExclusionBackend::exclude() batch
+    // Traced paths only: event arrival until the backend excluded them
+    LatencyHistogram endToEnd;
+  };
+  const Stats &stats() const { return m_stats; }
+
+  size_t pendingCount() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_pending.size();
+  }
+
+  // Called on the exclusion queue for every path once it is processed,
+  // with whether it ended up excluded.
+  void setOnFinished(
+      std::function<void(const std::string &, bool excluded)> callback) {
+    m_onFinished = std::move(callback);
+  }
+
+  // --signposts: every path is an os_signpost interval from enqueue() until
+  // it is processed, for Instruments.
+  void setSignposts(bool enabled) {
+    if (enabled)
+      m_signpostLog = os_log_create("com.asimov.watch", "Exclusions");
+  }
+
+  void enqueue(std::string_view path, const EventTrace &trace = {}) {
+    ++m_stats.requested;
+    std::string pathStr(path);
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto queued = m_queued.emplace(pathStr, m_pending.size());
+    if (!queued.second) {
+      m_pending[queued.first->second].trace.merge(trace);
+      return; // Already waiting
+    }
+    ++m_stats.queued;
+    Item item{std::move(pathStr), trace, OS_SIGNPOST_ID_NULL};
+    if (m_signpostLog) {
+      item.signpost = os_signpost_id_generate(m_signpostLog);
+      long long waitedUs =
+          trace ? std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - trace.arrived)
+                      .count()
+                : -1;
+      os_signpost_interval_begin(m_signpostLog, item.signpost, "Exclusion",
+                                 "%{public}s event=%llu since_event_us=%lld",
+                                 item.path.c_str(),
+                                 (unsigned long long)trace.eventId, waitedUs);
+    }
+    m_pending.push_back(std::move(item));
+    if (m_drainScheduled)
+      return;
+    m_drainScheduled = true;
+    dispatch_async(m_queue, ^{
+      drain();
+    });
+  }
+
+  // True when nothing is queued or in flight.
+  bool idle() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return !m_drainScheduled;
+  }
+
+  // Blocks until everything queued so far has been processed.
+  void flush() {
+    dispatch_sync(m_queue, ^{
+    });
+  }
+
+private:
+  struct Item {
+    std::string path;
+    EventTrace trace;
+    os_signpost_id_t signpost;
+  };
+
+  std::unique_ptr<ExclusionBackend> m_backend;
+  std::function<void(const std::string &, bool)> m_onFinished;
+  os_log_t m_signpostLog = nullptr;
+  dispatch_queue_t m_queue;
+  std::mutex m_lock;
+  std::vector<Item> m_pending;
+  std::unordered_map<std::string, size_t> m_queued; // index in m_pending
+  bool m_drainScheduled = false;
+  Stats m_stats;
+
+  void drain() {
+    std::vector<bool> results;
+    for (;;) {
+      std::vector<Item> batch;
+      {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_pending.empty()) {
+          m_drainScheduled = false;
+          return;
+        }
+        batch.swap(m_pending);
+        m_queued.clear();
+      }
+      // Shallow first: a project's node_modules matters more than the
+      // nested ones that happen to be in the same batch
+      std::stable_sort(batch.begin(), batch.end(),
+                       [](const Item &a, const Item &b) {
+                         return pathDepth(a.path) < pathDepth(b.path);
+                       });
+
+      // The backend takes the paths; their items stay behind in batch
+      std::vector<std::string> todo;
+      std::vector<const Item *> todoItems;
+      for (auto &item : batch) {
+        const std::string &pathStr = item.path;
+        // One lookup of the path for both the marker and the xattr
+        int dirFd = open(pathStr.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (m_backend->modifiesFilesystem())
+          createNeverIndexMarker(dirFd, pathStr);
+        bool excluded = dirFd >= 0 ? isExcludedFd(dirFd)
+                                   : isExcludedFast(pathStr.c_str());
+        if (dirFd >= 0)
+          close(dirFd);
+        if (!excluded) {
+          todo.push_back(std::move(item.path));
+          todoItems.push_back(&item);
+        } else {
+          ++m_stats.alreadyExcluded;
+          finish(pathStr, item, true, "already excluded");
+        }
+      }
+      if (todo.empty())
+        continue;
+
+      {
+        ScopedLatency timer(m_stats.backend);
+        m_backend->exclude(todo, results);
+      }
+      auto done = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < todo.size(); ++i) {
+        const Item &item = *todoItems[i];
+        if (results[i]) {
+          ++m_stats.excluded;
+          if (item.trace)
+            m_stats.endToEnd.record(done - item.trace.arrived);
+          LOG_INFO("✅ Excluded: " << todo[i]);
+          finish(todo[i], item, true, "excluded");
+        } else {
+          ++m_stats.failed;
+          LOG_ERROR("❌ Failed to exclude: " << todo[i]);
+          finish(todo[i], item, false, "failed");
+        }
+      }
+    }
+  }
+
+  void finish(const std::string &pathStr, const Item &item, bool excluded,
+              const char *outcome) {
+    if (item.signpost != OS_SIGNPOST_ID_NULL)
+      os_signpost_interval_end(m_signpostLog, item.signpost, "Exclusion",
+                               "%{public}s", outcome);
+    if (m_onFinished)
+      m_onFinished(pathStr, excluded);
+  }
+
+  static size_t pathDepth(const std::string &path) {
+    return std::count(path.begin(), path.end(), '/');
+  }
+
+  // Create .metadata_never_index to prevent Spotlight indexing. Relative
+  // to dirFd, or by full path if the directory couldn't be opened.
+  static void createNeverIndexMarker(int dirFd, const std::string &pathStr) {
+    static constexpr const char *kMarker = ".metadata_never_index";
+    std::string fullPath;
+    if (dirFd < 0)
+      fullPath = (fs::path(pathStr) / kMarker).string();
+    int fd = openat(dirFd >= 0 ? dirFd : AT_FDCWD,
+                    dirFd >= 0 ? kMarker : fullPath.c_str(),
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      close(fd);
+      LOG_DEBUG("Created .metadata_never_index in " << pathStr);
+    } else if (errno != EEXIST) {
+      LOG_WARN("Failed to create .metadata_never_index in " << pathStr);
+    }
+  }
+};
+
+// --- Benchmark Fixtures ---
+
+struct BenchEvent {
+  std::string path;
+  FSEventStreamEventFlags flags;
+};
+
+// Project flavours in the generated tree, one in every kBenchKinds projects
+enum BenchKind : unsigned {
+  kBenchNode,
+  kBenchRust,
+  kBenchPython,
+  kBenchPlain,
+  kBenchKinds
+};
+
+constexpr FSEventStreamEventFlags kBenchDirCreated =
+    kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemIsDir;
+constexpr FSEventStreamEventFlags kBenchFileCreated =
+    kFSEventStreamEventFlagItemCreated | kFSEventStreamEventFlagItemIsFile;
+constexpr FSEventStreamEventFlags kBenchFileModified =
+    kFSEventStreamEventFlagItemModified | kFSEventStreamEventFlagItemIsFile;
+constexpr FSEventStreamEventFlags kBenchFileRemoved =
+    kFSEventStreamEventFlagItemRemoved | kFSEventStreamEventFlagItemIsFile;
+constexpr FSEventStreamEventFlags kBenchFileRenamed =
+    kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagItemIsFile;
+constexpr FSEventStreamEventFlags kBenchDirRenamed =
+    kFSEventStreamEventFlagItemRenamed | kFSEventStreamEventFlagItemIsDir;
+
+static void touchFile(const fs::path &path) { std::ofstream out(path); }
+
+// root/group<N>/project<M>: sources everywhere, plus a populated dependency
+// directory next to its sentinel for every flavour but the plain one.
+// Returns the project directories; project i has flavour i % kBenchKinds.
+static std::vector<fs::path>
+generateBenchTree(const fs::path &root, unsigned projects, unsigned files) {
+  std::vector<fs::path> dirs;
+  for (unsigned p = 0; p < projects; ++p) {
+    fs::path dir = root / ("group" + std::to_string(p % 16)) /
+                   ("project" + std::to_string(p));
+    fs::path sources = dir / "src" / "module";
+    fs::create_directories(sources);
+    for (unsigned f = 0; f < files; ++f)
+      touchFile(sources / ("file" + std::to_string(f) + ".txt"));
+
+    for (unsigned i = 0; i < files; ++i) {
+      std::string n = std::to_string(i);
+      switch (p % kBenchKinds) {
+      case kBenchNode: {
+        fs::path pkg = dir / "node_modules" / ("pkg" + n);
+        fs::create_directories(pkg);
+        touchFile(pkg / "package.json");
+        touchFile(pkg / "index.js");
+        break;
+      }
+      case kBenchRust: {
+        fs::path deps = dir / "target" / "debug" / "deps";
+        fs::create_directories(deps);
+        touchFile(deps / ("libcrate" + n + ".rlib"));
+        touchFile(deps / ("crate" + n + ".d"));
+        break;
+      }
+      case kBenchPython: {
+        fs::path pkg = dir / ".venv" / "lib" / "site-packages" / ("pkg" + n);
+        fs::create_directories(pkg);
+        touchFile(pkg / "__init__.py");
+        break;
+      }
+      default: {
+        fs::path notes = dir / "docs" / ("part" + std::to_string(i % 4)) /
+                         ("chapter" + n);
+        fs::create_directories(notes);
+        touchFile(notes / "notes.md");
+        break;
+      }
+      }
+    }
+    switch (p % kBenchKinds) {
+    case kBenchNode:
+      touchFile(dir / "package.json");
+      break;
+    case kBenchRust:
+      touchFile(dir / "Cargo.toml");
+      break;
+    case kBenchPython:
+      touchFile(dir / "pyproject.toml");
+      break;
+    }
+    dirs.push_back(dir);
+  }
+  return dirs;
+}
+
+// The project that the i-th unit of work of a storm lands in
+static const fs::path &benchProject(const std::vector<fs::path> &projects,
+                                    BenchKind kind, size_t i) {
+  size_t perKind = std::max<size_t>(1, projects.size() / kBenchKinds);
+  size_t index = ((i / 100) % perKind) * kBenchKinds + kind;
+  return projects[std::min(index, projects.size() - 1)];
+}
+
+// npm install: packages unpacked into node_modules/.staging and moved into
+// place, each with its own package.json and nested dependencies.
+static void npmInstallStorm(const std::vector<fs::path> &projects,
+                            size_t budget, std::vector<BenchEvent> &out) {
+  for (size_t i = 0; out.size() < budget; ++i) {
+    fs::path project = benchProject(projects, kBenchNode, i);
+    fs::path modules = project / "node_modules";
+    std::string name = "dep" + std::to_string(i);
+    fs::path staging = modules / ".staging" / name;
+    fs::path pkg = modules / name;
+    out.push_back({staging.string(), kBenchDirCreated});
+    out.push_back({(staging / "package.json").string(), kBenchFileCreated});
+    out.push_back({(staging / "index.js").string(), kBenchFileCreated});
+    out.push_back({(staging / "lib").string(), kBenchDirCreated});
+    out.push_back({(staging / "lib" / "util.js").string(), kBenchFileCreated});
+    out.push_back({staging.string(), kBenchDirRenamed});
+    out.push_back({pkg.string(), kBenchDirRenamed});
+    out.push_back({(pkg / "node_modules").string(), kBenchDirCreated});
+    out.push_back({(pkg / "node_modules" / "nested" / "package.json").string(),
+                   kBenchFileCreated});
+    if (i % 50 == 0)
+      out.push_back({(project / "package-lock.json").string(),
+                     kBenchFileModified});
+  }
+}
+
+// cargo build: fingerprints, dep-info and rlibs written below target/
+static void cargoBuildStorm(const std::vector<fs::path> &projects,
+                            size_t budget, std::vector<BenchEvent> &out) {
+  for (size_t i = 0; out.size() < budget; ++i) {
+    fs::path debug = benchProject(projects, kBenchRust, i) / "target" / "debug";
+    std::string name = "crate" + std::to_string(i);
+    fs::path fingerprint = debug / ".fingerprint" / name;
+    out.push_back({fingerprint.string(), kBenchDirCreated});
+    out.push_back({(fingerprint / "lib-crate").string(), kBenchFileCreated});
+    out.push_back({(fingerprint / "dep-lib").string(), kBenchFileCreated});
+    out.push_back({(debug / "deps" / ("lib" + name + ".rlib")).string(),
+                   kBenchFileCreated | kBenchFileModified});
+    out.push_back(
+        {(debug / "deps" / (name + ".d")).string(), kBenchFileCreated});
+    fs::path incremental = debug / "incremental" / name;
+    out.push_back({(incremental / "s-working").string(), kBenchDirCreated});
+    out.push_back({(incremental / "s-working").string(), kBenchDirRenamed});
+    out.push_back({(incremental / "s-final").string(), kBenchDirRenamed});
+  }
+}
+
+// git checkout: the working tree rewritten through index.lock, sources
+// modified and removed, manifests replaced by rename.
+static void gitCheckoutStorm(const std::vector<fs::path> &projects,
+                             size_t budget, std::vector<BenchEvent> &out) {
+  for (size_t i = 0; out.size() < budget; ++i) {
+    const fs::path &project = projects[i % projects.size()];
+    fs::path git = project / ".git";
+    out.push_back({(git / "index.lock").string(), kBenchFileCreated});
+    for (unsigned f = 0; f < 16; ++f) {
+      fs::path file = project / "src" / "module" /
+                      ("file" + std::to_string(f) + ".txt");
+      out.push_back(
+          {file.string(), f % 4 ? kBenchFileModified : kBenchFileRemoved});
+    }
+    if (i % kBenchKinds == kBenchNode)
+      out.push_back({(project / "package.json").string(), kBenchFileRenamed});
+    out.push_back({(git / "index.lock").string(), kBenchFileRenamed});
+    out.push_back({(git / "index").string(), kBenchFileRenamed});
+  }
+}
+
+class AsimovWatcher {
+public:
+  explicit AsimovWatcher(const Options &options)
+      : m_scanThreads(options.scanThreads),
+        m_scanMemory(size_t(options.scanMemoryMb) * 1024 * 1024),
+        m_pruneNames(options.pruneNames),
+        m_exclusions(makeExclusionBackend(options.backend)),
+        m_shardCount(options.eventShards), m_debounceMs(options.debounceMs),
+        m_dirEvents(options.dirEvents), m_noDefer(options.noDefer),
+        m_latency(options.latency), m_maxLatency(options.maxLatency),
+        m_currentLatency(options.latency) {
+    addRoots(options.roots);
+
+    m_checkpointPath = defaultCheckpointPath();
+    m_indexPath = m_checkpointPath + ".index";
+    m_metricsSocketPath = options.metricsSocket;
+
+    m_configRequired = !options.configPath.empty();
+    m_configPath = m_configRequired ? options.configPath : defaultConfigPath();
+    std::unique_ptr<RuleConfig> config;
+    std::string error;
+    if (!loadConfig(config, error)) {
+      LOG_ERROR("Invalid config " << m_configPath << ": " << error);
+      exit(1);
+    }
+    applyConfig(std::move(config));
+
+    ScanThrottle::Policy policy;
+    ScanThrottle::parseQoS(options.scanQos, policy.qos);
+    policy.entriesPerSecond = options.scanRate;
+    policy.pauseOnBattery = options.pauseOnBattery;
+    policy.pauseOnThermal = options.pauseOnThermal;
+    m_scanThrottle.configure(policy);
+    parseVolumePolicy(options.volumes, m_volumePolicy);
+    m_deviceStreamsEnabled = options.deviceStreams;
+
+    // Excluded before the in-flight mark goes, so events below dir are
+    // dropped throughout
+    m_exclusions.setSignposts(options.signposts);
+    m_exclusions.setOnFinished([this](const std::string &dir, bool excluded) {
+      if (excluded)
+        rememberExcluded(dir);
+      m_paths.finishExcluding(dir);
+    });
+
+    if (m_scanThreads == 0)
+      m_scanThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (m_shardCount == 0)
+      m_shardCount = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  void run() {
+    std::string roots;
+    for (size_t i = 0; i < m_roots.size(); ++i)
+      roots += (i ? ", " : "") + m_roots[i].path.string();
+    LOG_DEBUG("Asimov Watcher started on " << roots);
+    LOG_DEBUG("Exclusion backend: " << m_exclusions.backendName());
+    std::ostringstream adaptive;
+    if (m_maxLatency > m_latency)
+      adaptive << " (adaptive up to " << m_maxLatency << "s)";
+    LOG_DEBUG("Watching " << (m_dirEvents ? "directory" : "file")
+                          << "-level events, latency " << m_latency << "s"
+                          << adaptive.str() << ", " << m_shardCount
+                          << " event shards");
+    std::string ignored;
+    for (const auto &dir : m_ignoreDirs)
+      ignored += dir + ", ";
+    LOG_DEBUG("Ignoring directories: " << ignored);
+    LOG_DEBUG(config().ruleCount() << " rules (config: " << m_configPath
+                                   << ")");
+
+    m_eventQueue = dispatch_queue_create("com.asimov.fsevents", NULL);
+    createShards();
+    dispatch_sync(m_eventQueue, ^{
+      refreshVolumes();
+    });
+
+    // 1. Resume from the last checkpoint, or fall back to a full scan
+    FSEventStreamEventId sinceWhen = resolveStartEventId();
+    m_lastEventId = (sinceWhen == kFSEventStreamEventIdSinceNow)
+                        ? FSEventsGetCurrentEventId()
+                        : sinceWhen;
+    if (m_replaying) {
+      size_t known = m_index.load(m_indexPath, sinceWhen);
+      LOG_DEBUG("Exclusion index: " << known
+                                     << " known excluded directories");
+    } else {
+      startFullScan("no valid checkpoint");
+    }
+
+    installTerminationHandlers();
+    installReloadHandler();
+    installMetricsHandlers();
+
+    // 2. Start FSEvents Monitor: one stream for all roots, except those
+    // that got a device stream
+    dispatch_sync(m_eventQueue, ^{
+      startDeviceStreams();
+    });
+    std::vector<CFStringRef> paths;
+    for (const auto &root : m_roots) {
+      if (root.deviceStream)
+        continue;
+      paths.push_back(CFStringCreateWithCString(NULL, root.path.c_str(),
+                                                kCFStringEncodingUTF8));
+    }
+    m_pathsToWatch = CFArrayCreate(NULL, (const void **)paths.data(),
+                                   paths.size(), &kCFTypeArrayCallBacks);
+    for (CFStringRef path : paths)
+      CFRelease(path);
+
+    if (!paths.empty()) {
+      dispatch_sync(m_eventQueue, ^{
+        startStream(sinceWhen);
+      });
+    }
+
+    // Keep main thread alive
+    dispatch_main();
+  }
+
+  // Runs the scanner and the event pipeline against the projects of a
+  // generated tree, see runBenchmark(). There is no stream: storms are fed
+  // to the FSEvents callback directly, in batches like FSEvents delivers.
+  void benchmark(const std::vector<fs::path> &projects, size_t stormEvents) {
+    m_eventQueue = dispatch_queue_create("com.asimov.fsevents", NULL);
+    createShards();
+
+    // Per-path logging would dominate the timings
+    std::ostream &report = std::cout;
+    LogLevel level = logger().level();
+    logger().setLevel(LogLevel::Warn);
+
+    report << "Backend: " << m_exclusions.backendName() << ", "
+           << m_scanThreads << " scan threads, " << m_shardCount
+           << " event shards, debounce " << m_debounceMs << "ms" << std::endl;
+
+    // The OS caches are warm from generating the tree either way; "cold"
+    // means our own caches are empty.
+    for (const char *phase : {"scan (cold)", "scan (warm)"}) {
+      auto started = std::chrono::steady_clock::now();
+      size_t dirs = scanRoots();
+      m_exclusions.flush();
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - started;
+      reportScan(report, phase, elapsed.count(), dirs, m_scanStats);
+      report << ", " << m_scanStats.prunedTargets << " targets pruned"
+             << std::endl;
+    }
+
+    using StormFn = void (*)(const std::vector<fs::path> &, size_t,
+                             std::vector<BenchEvent> &);
+    const std::pair<const char *, StormFn> storms[] = {
+        {"npm install", npmInstallStorm},
+        {"cargo build", cargoBuildStorm},
+        {"git checkout", gitCheckoutStorm},
+    };
+    for (const auto &storm : storms) {
+      std::vector<BenchEvent> events;
+      events.reserve(stormEvents + 32);
+      storm.second(projects, stormEvents, events);
+      benchmarkStorm(report, storm.first, events);
+    }
+
+    logger().setLevel(level);
+  }
+
+  // Scans the roots once with the rules in effect, see runReport(), then
+  // walks every target the scan found to add up what excluding it saves.
+  // Sizes are allocated bytes summed per path, so hard links and clones
+  // count once for every path they appear under.
+  void report() {
+    std::ostream &report = std::cout;
+    LogLevel level = logger().level();
+    logger().setLevel(LogLevel::Warn);
+    refreshVolumes();
+
+    report << "Dry run: backend " << m_exclusions.backendName() << ", "
+           << m_roots.size() << " root(s), " << m_scanThreads
+           << " scan threads" << std::endl;
+
+    m_auditing = true;
+    auto started = std::chrono::steady_clock::now();
+    size_t dirs = scanRoots();
+    m_exclusions.flush();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - started;
+    m_auditing = false;
+    reportScan(report, "scan", elapsed.count(), dirs, m_scanStats);
+    report << std::endl;
+
+    std::sort(m_auditTargets.begin(), m_auditTargets.end());
+    ScanStats sizeStats;
+    started = std::chrono::steady_clock::now();
+    std::vector<uint64_t> sizes = sizeTargets(sizeStats, dirs);
+    elapsed = std::chrono::steady_clock::now() - started;
+    reportScan(report, "sizing", elapsed.count(), dirs, sizeStats);
+    report << std::endl;
+
+    const ConfigRuleTable &table = config().table();
+    struct RuleTotal {
+      size_t rule;
+      uint64_t directories = 0;
+      uint64_t bytes = 0;
+    };
+    std::vector<RuleTotal> totals;
+    for (size_t i = 0; i < table.ruleCount(); ++i)
+      totals.push_back({i});
+    uint64_t totalBytes = 0;
+    for (size_t t = 0; t < m_auditTargets.size(); ++t) {
+      RuleTotal &total = totals[m_auditTargets[t].second];
+      ++total.directories;
+      total.bytes += sizes[t];
+      totalBytes += sizes[t];
+    }
+    std::stable_sort(totals.begin(), totals.end(),
+                     [](const RuleTotal &a, const RuleTotal &b) {
+                       return a.bytes > b.bytes;
+                     });
+
+    report << "Would exclude " << m_auditTargets.size() << " directories, "
+           << formatBytes(totalBytes) << " allocated ("
+           << m_exclusions.stats().alreadyExcluded << " already excluded)"
+           << std::endl;
+    for (const auto &total : totals) {
+      if (!total.directories)
+        continue;
+      const Rule &rule = table.rule(total.rule);
+      report << "  " << rule.value << " next to " << rule.key << ": "
+             << total.directories << " directories, "
+             << formatBytes(total.bytes) << std::endl;
+    }
+
+    logger().setLevel(level);
+  }
+
+private:
+  // A watched tree. Roots never nest, so every path belongs to at most one.
+  struct WatchRoot {
+    fs::path path;
+    std::string prefix; // path with a trailing '/'
+    std::string deviceUUID;
+    bool deviceStream = false; // watched by a DeviceStream, see run()
+  };
+
+  std::vector<WatchRoot> m_roots; // sorted by path
+  // Rules in effect, swapped whole by reloadConfig(). Configs are never
+  // freed: events and pending targets in flight still point into old ones.
+  std::atomic<const RuleConfig *> m_config{nullptr};
+  std::vector<std::unique_ptr<RuleConfig>> m_configs; // on m_eventQueue
+  std::string m_configPath;
+  bool m_configRequired = false; // --config given: a missing file is an error
+  std::vector<std::string> m_rootIgnores; // absolute, from the arguments
+  std::vector<std::string> m_ignoreDirs; // For logging; lookups use m_paths
+  unsigned m_scanThreads;
+  size_t m_scanMemory; // bytes of scan work stacks, 0 = unlimited
+  std::vector<std::string> m_pruneNames; // --prune, added to every config
+  ExclusionQueue m_exclusions;
+  static constexpr size_t kExcludedCacheCapacity = 16384;
+  PathClassifier m_paths{kExcludedCacheCapacity};
+  ExclusionIndex m_index; // Unbounded, persisted next to the checkpoint
+  ScanStats m_scanStats;
+  // --dry-run --report: the targets the scan excluded, with the index of
+  // the rule that matched, see report()
+  bool m_auditing = false;
+  std::mutex m_auditLock;
+  std::vector<std::pair<std::string, uint16_t>> m_auditTargets;
+  // Per-thread listing buffers past this many entries are freed after use
+  static constexpr size_t kKeepEntries = 16384;
+  // Directory descriptors each scan worker and each shard keeps open,
+  // small enough to stay well clear of the default 256 descriptor limit
+  static constexpr size_t kScanFdCache = 8;
+  static constexpr size_t kShardFdCache = 8;
+  ScanThrottle m_scanThrottle;
+
+  // Hot path accounting, written on m_eventQueue once per callback so the
+  // metrics dump can read it from anywhere. Filtered events are the ones
+  // checkPath rejected; they are expected to never allocate.
+  struct EventStats {
+    std::atomic<uint64_t> callbacks{0};
+    std::atomic<uint64_t> events{0};
+    std::atomic<uint64_t> filtered{0};
+    std::atomic<uint64_t> filteredAllocations{0};
+    // Filtered because they are below an excluded or excluding directory
+    std::atomic<uint64_t> belowExcluded{0};
+    std::atomic<uint64_t> urgent{0}; // sent to a shard's urgent lane
+  } m_eventStats;
+
+  // Everything else the metrics dump reports that has no better home
+  struct Metrics {
+    LatencyHistogram callback;       // one FSEvents callback
+    LatencyHistogram shardLag;       // batch queued until a shard runs it
+    LatencyHistogram parentExcluded; // isParentExcluded()
+    LatencyHistogram scanDirectory;  // one directory of the scan
+    // Event arrival until its target was handed to the exclusion queue;
+    // the rest of the way is ExclusionQueue::Stats::endToEnd
+    LatencyHistogram eventToQueue;
+    std::atomic<uint64_t> parentExcludedCalls{0};
+    std::atomic<uint64_t> parentExcludedProbes{0};
+    std::atomic<uint64_t> scans{0};
+    std::atomic<uint64_t> rescanTrees{0}; // subtrees rescanned
+    // Callbacks, timers and signals the daemon was woken up by
+    std::atomic<uint64_t> wakeups{0};
+    std::atomic<uint64_t> idlePeriods{0};
+  } m_metrics;
+  std::chrono::steady_clock::time_point m_started =
+      std::chrono::steady_clock::now();
+  dispatch_queue_t m_metricsQueue = nullptr;
+  // Previous dump, for the wakeup rate; on m_metricsQueue
+  uint64_t m_dumpWakeups = 0;
+  std::chrono::steady_clock::time_point m_dumpAt = m_started;
+  std::vector<dispatch_source_t> m_metricsSources;
+  std::string m_metricsSocketPath;
+
+  // A directory that may have to be excluded, with every rule that pointed
+  // at it during the current window.
+  struct PendingRule {
+    const Rule *rule;
+    bool sentinelSeen;
+    EventTrace trace; // oldest event for this rule and target
+  };
+  using PendingTarget = std::vector<PendingRule>;
+
+  // A relevant event on its way from the stream queue to a shard
+  struct ShardEvent {
+    enum Kind : uint8_t {
+      kRuleName,  // path's name is a sentinel or target
+      kDirectory, // directory-level mode: path's contents changed
+      kRemoved,   // directory at path was removed or renamed
+    };
+    std::string_view path; // in the batch's arena once queued
+    Kind kind;
+    const RuleName *ruleName; // kRuleName only, points into a RuleConfig
+    bool sentinelSeen;
+    EventTrace trace;
+  };
+
+  // The events one callback has for one shard. Batches go back to
+  // m_spareBatches after the shard ran them, arena and vector capacity
+  // included, so a warm event path doesn't allocate for them.
+  struct ShardBatch {
+    std::vector<ShardEvent> events;
+    PathArena paths{16 * 1024}; // most batches are a handful of events
+    std::chrono::steady_clock::time_point queued; // for the shard lag
+  };
+
+  // Each shard runs its batches from two lanes. The urgent lane gets the
+  // rule name events outside of any target directory (package.json or
+  // node_modules of a project), the normal lane everything else, e.g. the
+  // thousands of package.json inside a node_modules being installed.
+  // Coalescing is order-independent, so reordering batches is safe.
+  enum Lane : unsigned { kUrgentLane, kNormalLane, kLanes };
+
+  static constexpr size_t kMissingCacheCapacity = 4096; // per shard
+
+  // Relevant events are coalesced and evaluated on one of several serial
+  // queues, picked by the project directory the event belongs to. Events
+  // of one project keep their order; unrelated projects proceed in
+  // parallel. Everything in a shard is only touched on its queue.
+  //
+  // Targets are keyed by path; pendingTrie marks the same paths so
+  // descendants are found in one walk.
+  struct EventShard {
+    dispatch_queue_t queue = nullptr;
+    std::unordered_map<std::string, PendingTarget> pendingTargets;
+    PathTrie pendingTrie;
+    // Directory-level mode, with the oldest event for each
+    std::unordered_map<std::string, EventTrace> pendingDirs;
+    ScanStats listStats;
+    MissingPathCache missing{kMissingCacheCapacity};
+    DirFdCache dirFds{kShardFdCache}; // closed after every flush
+    bool flushScheduled = false;
+    // Batches dispatched to the queue, see runNextBatch()
+    std::mutex laneLock;
+    std::deque<ShardBatch *> lanes[kLanes];
+    // Written on the queue only; atomic so the metrics dump can read them
+    std::atomic<uint64_t> coalesced{0}; // Folded into a pending target
+    std::atomic<uint64_t> evaluated{0}; // Pending targets actually probed
+    std::atomic<uint64_t> ignored{0};   // Targets below an ignored dir
+    std::atomic<uint64_t> probesSaved{0}; // Probes answered by missing
+    std::atomic<uint64_t> probes{0};      // getxattr/access calls
+    std::atomic<uint64_t> allocations{0};
+  };
+
+  // Path components below the watch root that make up a shard key, e.g.
+  // "Projects/foo" for ~/Projects/foo/node_modules
+  static constexpr unsigned kShardDepth = 2;
+
+  unsigned m_shardCount;
+  std::vector<std::unique_ptr<EventShard>> m_shards;
+  // Per-shard, per-lane batch being filled by the current callback, on
+  // m_eventQueue; null until the callback has an event for it
+  std::vector<ShardBatch *> m_batches; // shard * kLanes + lane
+  std::mutex m_spareBatchLock;
+  std::vector<std::unique_ptr<ShardBatch>> m_spareBatches;
+  // Batches in flight plus flushes scheduled, across all shards. Zero means
+  // every event seen so far has been evaluated.
+  std::atomic<uint64_t> m_shardWork{0};
+  unsigned m_debounceMs;
+
+  // Stream configuration and state, only touched on m_eventQueue
+  FSEventStreamRef m_stream = nullptr;
+  CFArrayRef m_pathsToWatch = nullptr;
+  bool m_dirEvents;
+  bool m_noDefer;
+  double m_latency;
+  double m_maxLatency;
+  double m_currentLatency;
+  uint64_t m_rateEvents = 0;
+  std::chrono::steady_clock::time_point m_rateWindowStart;
+  bool m_rateCheckScheduled = false;
+
+  // --device-streams: roots on another volume than the boot volume, one
+  // stream per device. Their paths are relative to the volume and their
+  // ids count in its own database, so they have no checkpoint; they start
+  // from now and their roots are rescanned instead of replayed.
+  struct DeviceStream {
+    AsimovWatcher *watcher;
+    dev_t device;
+    std::string mountPoint;
+    std::vector<std::string> relativePaths;
+    FSEventStreamRef stream = nullptr;
+  };
+  bool m_deviceStreamsEnabled;
+  std::vector<std::unique_ptr<DeviceStream>> m_deviceStreams;
+
+  VolumePolicy m_volumePolicy;
+  std::set<std::string> m_skippedVolumes; // logged once, on m_eventQueue
+
+  static constexpr std::chrono::seconds kRateWindow{2};
+  static constexpr double kStormEventsPerSecond = 500;
+  static constexpr double kQuietEventsPerSecond = 20;
+
+  // Checkpoint state. m_lastEventId is written on the event queue and read
+  // when the scan finishes; everything else is only touched on the queue.
+  dispatch_queue_t m_eventQueue = nullptr;
+  std::vector<dispatch_source_t> m_signalSources;
+  std::string m_checkpointPath;
+  std::string m_indexPath;
+  std::atomic<FSEventStreamEventId> m_lastEventId{0};
+  std::atomic<bool> m_scanRunning{false};
+  bool m_replaying = false;
+  std::chrono::steady_clock::time_point m_lastCheckpointSave;
+
+  // Subtrees to rescan after lost events, only touched on m_eventQueue.
+  // The checkpoint stays put until they are done.
+  std::set<std::string, std::less<>> m_rescanPending;
+  bool m_rescanScheduled = false;
+  bool m_rescanRunning = false;
+  // Why a full scan is due once the running rescan is done, or null; the
+  // two would share m_scanStats and the throttle
+  const char *m_fullScanDeferred = nullptr;
+  std::chrono::steady_clock::time_point m_lastRescan;
+  // Drops come in bursts; wait for the burst to end before walking
+  static constexpr std::chrono::seconds kRescanDelay{2};
+  static constexpr std::chrono::seconds kRescanInterval{30};
+
+  // Idle mode, only touched on m_eventQueue (m_idle is read by the
+  // metrics dump). See noteActivity().
+  std::chrono::steady_clock::time_point m_lastActivity;
+  std::atomic<bool> m_idle{false};
+  bool m_idleCheckScheduled = false;
+  // Events handed to the shards, removal bookkeeping aside: only these
+  // count as activity
+  uint64_t m_queuedEvents = 0;
+  static constexpr std::chrono::seconds kIdleAfter{60};
+  static constexpr std::chrono::seconds kIdleLeeway{10};
+
+  // Don't rewrite the checkpoint file more often than this. Replaying a few
+  // seconds of history after a crash is harmless since exclusion is
+  // idempotent.
+  static constexpr std::chrono::seconds kCheckpointInterval{10};
+
+  // --- Benchmark ---
+
+  struct EventTotals {
+    uint64_t events = 0;
+    uint64_t filteredAllocations = 0;
+    uint64_t evaluated = 0;
+    uint64_t syscalls = 0;
+    uint64_t allocations = 0;
+  };
+
+  // Only call while the event queue and every shard are quiet.
+  EventTotals eventTotals() const {
+    EventTotals totals;
+    totals.events = m_eventStats.events;
+    totals.filteredAllocations = m_eventStats.filteredAllocations;
+    for (const auto &shard : m_shards) {
+      totals.evaluated += shard->evaluated;
+      totals.syscalls += shard->probes + shard->listStats.syscalls;
+      totals.allocations += shard->allocations;
+    }
+    return totals;
+  }
+
+  // Prints "<phase>: time, directories, entries, rates" without the newline.
+  static void reportScan(std::ostream &report, const char *phase,
+                         double seconds, size_t dirs, const ScanStats &stats) {
+    double entries = std::max(double(stats.entries), 1.0);
+    report << phase << ": " << std::fixed << std::setprecision(3) << seconds
+           << "s, " << dirs << " directories, " << stats.entries
+           << " entries, " << std::setprecision(0) << stats.entries / seconds
+           << " entries/s, " << std::setprecision(3)
+           << stats.syscalls / entries << " syscalls/entry, "
+           << stats.allocations / entries << " allocations/entry";
+  }
+
+  static std::string formatBytes(uint64_t bytes) {
+    static const char *const kUnits[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = double(bytes);
+    size_t unit = 0;
+    while (value >= 1024 && unit + 1 < std::size(kUnits)) {
+      value /= 1024;
+      ++unit;
+    }
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(unit ? 1 : 0) << value << ' '
+        << kUnits[unit];
+    return out.str();
+  }
+
+  // Allocated bytes below each of the (sorted) m_auditTargets, walked by
+  // the scan workers with sizes requested from the bulk listing. Targets
+  // never nest: the scan does not descend into them.
+  std::vector<uint64_t> sizeTargets(ScanStats &stats, size_t &dirs) {
+    std::unordered_map<std::string_view, size_t> owners;
+    std::vector<fs::path> roots;
+    for (size_t t = 0; t < m_auditTargets.size(); ++t) {
+      owners.emplace(m_auditTargets[t].first, t);
+      roots.push_back(m_auditTargets[t].first);
+    }
+    std::vector<std::atomic<uint64_t>> sizes(m_auditTargets.size());
+
+    // The nearest target at or above dir
+    auto ownerOf = [&owners](std::string_view dir) {
+      for (;;) {
+        auto it = owners.find(dir);
+        if (it != owners.end())
+          return it->second;
+        size_t slash = dir.rfind('/');
+        if (slash == std::string_view::npos || slash == 0)
+          return size_t(-1);
+        dir = dir.substr(0, slash);
+      }
+    };
+
+    WorkStealingScanner scanner(
+        m_scanThreads,
+        [&](const fs::path &dir, SubdirList &subdirs) {
+          thread_local std::vector<DirEntry> entries;
+          uint64_t allocationsBefore = t_allocations;
+          ++stats.directories;
+          BulkDirectoryReader::list(dir.native(), entries, stats, true);
+          uint64_t bytes = 0;
+          for (const auto &entry : entries) {
+            if (entry.type == EntryType::Directory)
+              subdirs.add(dir.native(), entry.name);
+            else
+              bytes += entry.size;
+          }
+          size_t owner = bytes ? ownerOf(dir.native()) : size_t(-1);
+          if (owner != size_t(-1))
+            sizes[owner] += bytes;
+          stats.allocations += t_allocations - allocationsBefore;
+          m_scanThrottle.pace(entries.size());
+        },
+        &m_scanThrottle, m_scanMemory);
+    try {
+      scanner.run(roots);
+    } catch (const std::exception &e) {
+      LOG_ERROR("Sizing failed: " << e.what());
+    }
+    dirs = scanner.directoriesVisited();
+
+    std::vector<uint64_t> result;
+    for (const auto &size : sizes)
+      result.push_back(size);
+    return result;
+  }
+
+  void benchmarkStorm(std::ostream &report, const char *name,
+                      const std::vector<BenchEvent> &events) {
+    constexpr size_t kBatchSize = 1024;
+    std::vector<char *> paths(kBatchSize);
+    std::vector<FSEventStreamEventFlags> flags(kBatchSize);
+    std::vector<FSEventStreamEventId> ids(kBatchSize);
+    char **pathData = paths.data();
+    FSEventStreamEventFlags *flagData = flags.data();
+    FSEventStreamEventId *idData = ids.data();
+    uint64_t callbackAllocations = 0;
+    uint64_t *callbackTotal = &callbackAllocations;
+
+    EventTotals before = eventTotals();
+    auto started = std::chrono::steady_clock::now();
+    for (size_t begin = 0; begin < events.size(); begin += kBatchSize) {
+      size_t count = std::min(kBatchSize, events.size() - begin);
+      for (size_t i = 0; i < count; ++i) {
+        paths[i] = const_cast<char *>(events[begin + i].path.c_str());
+        flags[i] = events[begin + i].flags;
+        ids[i] = m_lastEventId + 1 + i;
+      }
+      dispatch_sync(m_eventQueue, ^{
+        uint64_t allocationsBefore = t_allocations;
+        fsEventCallbackWrapper(nullptr, this, count, pathData, flagData,
+                               idData);
+        *callbackTotal += t_allocations - allocationsBefore;
+      });
+    }
+    // Shard queues are FIFO, so this waits for every batch as well
+    for (auto &owned : m_shards) {
+      EventShard *shard = owned.get();
+      dispatch_sync(shard->queue, ^{
+        flushCandidates(*shard);
+      });
+    }
+    m_exclusions.flush();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - started;
+    EventTotals after = eventTotals();
+
+    double count = double(after.events - before.events);
+    report << name << ": " << std::fixed << std::setprecision(3)
+           << elapsed.count() << "s, " << events.size() << " events, "
+           << std::setprecision(0) << count / elapsed.count()
+           << " events/s, " << std::setprecision(3)
+           << (after.syscalls - before.syscalls) / count
+           << " syscalls/event, "
+           << (callbackAllocations + after.allocations - before.allocations) /
+                  count
+           << " allocations/event ("
+           << after.filteredAllocations - before.filteredAllocations
+           << " in filtered events), " << after.evaluated - before.evaluated
+           << " targets evaluated" << std::endl;
+  }
+
+  // --- Static Callback Wrapper ---
+  static void fsEventCallbackWrapper(ConstFSEventStreamRef streamRef,
+                                     void *clientCallBackInfo, size_t numEvents,
+                                     void *eventPaths,
+                                     const FSEventStreamEventFlags eventFlags[],
+                                     const FSEventStreamEventId eventIds[]) {
+    processEvents(static_cast<AsimovWatcher *>(clientCallBackInfo), numEvents,
+                  (const char *const *)eventPaths, eventFlags, eventIds);
+  }
+
+  // Paths of a per-device stream are relative to the volume; make them
+  // absolute in a per-callback arena. Its event ids count in the volume's own
+  // database, so they don't move the checkpoint.
+  static void deviceEventCallback(ConstFSEventStreamRef streamRef,
+                                  void *clientCallBackInfo, size_t numEvents,
+                                  void *eventPaths,
+                                  const FSEventStreamEventFlags eventFlags[],
+                                  const FSEventStreamEventId eventIds[]) {
+    DeviceStream *device = static_cast<DeviceStream *>(clientCallBackInfo);
+    thread_local PathArena joined;
+    thread_local std::vector<const char *> paths;
+    joined.reset();
+    paths.resize(numEvents);
+    for (size_t i = 0; i < numEvents; ++i) {
+      const char *relative = ((const char *const *)eventPaths)[i];
+      while (*relative == '/')
+        ++relative;
+      paths[i] = (*relative ? joined.join(device->mountPoint, relative)
+                            : joined.store(device->mountPoint))
+                     .data();
+    }
+    processEvents(device->watcher, numEvents, paths.data(), eventFlags,
+                  nullptr);
+  }
+
+  // eventIds is null for events that must not move the checkpoint.
+  static void processEvents(AsimovWatcher *watcher, size_t numEvents,
+                            const char *const *paths,
+                            const FSEventStreamEventFlags eventFlags[],
+                            const FSEventStreamEventId eventIds[]) {
+    // SAFETY: Prevent C++ exceptions from unwinding into C stack frames
+    try {
+      ScopedLatency timer(watcher->m_metrics.callback);
+      // Replayed history is catching up, not reacting: left untraced
+      std::chrono::steady_clock::time_point arrived;
+      if (!watcher->m_replaying)
+        arrived = std::chrono::steady_clock::now();
+      FSEventStreamEventId lastId = 0;
+      uint64_t events = 0, filtered = 0, filteredAllocations = 0;
+      uint64_t queuedBefore = watcher->m_queuedEvents;
+      for (size_t i = 0; i < numEvents; i++) {
+        if (eventIds && eventIds[i] > lastId)
+          lastId = eventIds[i];
+        if (!watcher->m_replaying)
+          watcher->handleLostEvents(paths[i], eventFlags[i]);
+        if (watcher->handleHistoryFlags(eventFlags[i]))
+          continue;
+
+        uint64_t allocationsBefore = t_allocations;
+        EventTrace trace{arrived, eventIds ? eventIds[i] : 0};
+        bool relevant =
+            watcher->m_dirEvents
+                ? watcher->checkDirectory(paths[i], trace)
+                : watcher->checkPath(paths[i], eventFlags[i], trace);
+        ++events;
+        if (!relevant) {
+          ++filtered;
+          filteredAllocations += t_allocations - allocationsBefore;
+        }
+      }
+      EventStats &stats = watcher->m_eventStats;
+      ++stats.callbacks;
+      ++watcher->m_metrics.wakeups;
+      if (watcher->m_queuedEvents != queuedBefore)
+        watcher->noteActivity();
+      stats.events += events;
+      stats.filtered += filtered;
+      stats.filteredAllocations += filteredAllocations;
+      watcher->dispatchBatches();
+      if (eventIds)
+        watcher->noteEventRate(numEvents);
+      if (lastId != 0)
+        watcher->recordEventId(lastId);
+    } catch (const std::exception &e) {
+      LOG_ERROR("Exception in FSEvents callback: " << e.what());
+    } catch (...) {
+      LOG_ERROR("Unknown exception in FSEvents callback");
+    }
+  }
+
+  // --- Stream Management ---
+
+  // Must run on m_eventQueue.
+  void startStream(FSEventStreamEventId sinceWhen) {
+    // Pass 'this' instance to the C-style callback
+    FSEventStreamContext context = {0, (void *)this, NULL, NULL, NULL};
+
+    m_stream = FSEventStreamCreate(
+        NULL, &AsimovWatcher::fsEventCallbackWrapper, &context, m_pathsToWatch,
+        sinceWhen, m_currentLatency, streamFlags());
+
+    FSEventStreamSetDispatchQueue(m_stream, m_eventQueue);
+
+    if (!FSEventStreamStart(m_stream)) {
+      LOG_ERROR("Failed to start FSEvent stream");
+      exit(1);
+    }
+  }
+
+  FSEventStreamCreateFlags streamFlags() const {
+    // WatchRoot: tell us when a root itself is moved, deleted or recreated,
+    // see handleLostEvents()
+    FSEventStreamCreateFlags flags = kFSEventStreamCreateFlagWatchRoot;
+    if (!m_dirEvents)
+      flags |= kFSEventStreamCreateFlagFileEvents;
+    if (m_noDefer)
+      flags |= kFSEventStreamCreateFlagNoDefer;
+    return flags;
+  }
+
+  // Latency is fixed per stream, so changing it means a new stream. The new
+  // one resumes right after the last processed event, so nothing is lost.
+  // Must run on m_eventQueue, outside of the stream's callback.
+  void restartStream() {
+    FSEventStreamStop(m_stream);
+    FSEventStreamInvalidate(m_stream);
+    FSEventStreamRelease(m_stream);
+    startStream(m_lastEventId);
+  }
+
+  // --- Adaptive Latency ---
+
+  // Low latency while the filesystem is quiet, for fast reaction; high
+  // latency during storms, so FSEvents hands us fewer, bigger batches.
+  void noteEventRate(size_t numEvents) {
+    if (m_maxLatency <= m_latency)
+      return;
+    m_rateEvents += numEvents;
+    auto now = std::chrono::steady_clock::now();
+    if (now - m_rateWindowStart >= kRateWindow)
+      evaluateEventRate(now);
+  }
+
+  void evaluateEventRate(std::chrono::steady_clock::time_point now) {
+    std::chrono::duration<double> window = now - m_rateWindowStart;
+    double rate = window.count() > 0 ? m_rateEvents / window.count() : 0;
+    m_rateEvents = 0;
+    m_rateWindowStart = now;
+
+    double wanted = m_currentLatency;
+    if (rate >= kStormEventsPerSecond)
+      wanted = m_maxLatency;
+    else if (rate <= kQuietEventsPerSecond)
+      wanted = m_latency;
+
+    if (wanted != m_currentLatency) {
+      LOG_DEBUG(std::fixed << std::setprecision(0) << rate
+                           << " events/s, switching latency to "
+                           << std::setprecision(2) << wanted << "s");
+      m_currentLatency = wanted;
+      dispatch_async(m_eventQueue, ^{
+        restartStream();
+      });
+    }
+
+    // With high latency a quiet filesystem produces no callbacks at all, so
+    // keep sampling on a timer until we are back to normal
+    if (m_currentLatency > m_latency && !m_rateCheckScheduled) {
+      m_rateCheckScheduled = true;
+      runAfter(m_eventQueue, kRateWindow, kRateWindow / 4, ^{
+        m_rateCheckScheduled = false;
+        evaluateEventRate(std::chrono::steady_clock::now());
+      });
+    }
+  }
+
+  // --- Rule Configuration ---
+
+  const RuleConfig &config() const {
+    return *m_config.load(std::memory_order_acquire);
+  }
+
+  static std::string defaultConfigPath() {
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+      return "";
+    return (fs::path(home) / "Library" / "Application Support" /
+            "asimov-watch" / "config")
+        .string();
+  }
+
+  // Without a config file the built-in rules apply, unless --config named
+  // one that can't be read.
+  bool loadConfig(std::unique_ptr<RuleConfig> &out, std::string &error) const {
+    RuleSpec spec;
+    std::ifstream in;
+    if (!m_configPath.empty())
+      in.open(m_configPath);
+    if (in.is_open()) {
+      if (!parseRuleSpec(in, spec, error))
+        return false;
+    } else if (m_configRequired) {
+      error = "can't open it";
+      return false;
+    }
+    spec.pruneNames.insert(spec.pruneNames.end(), m_pruneNames.begin(),
+                           m_pruneNames.end());
+    out = RuleConfig::compile(spec, error);
+    return out != nullptr;
+  }
+
+  // Ignore paths go into the trie before the rules are published, both
+  // together with the ones from the arguments.
+  void applyConfig(std::unique_ptr<RuleConfig> config) {
+    std::vector<std::string> ignores = m_rootIgnores;
+    const char *home = getenv("HOME");
+    for (const auto &ignore : config->spec().ignores) {
+      if (ignore[0] == '/')
+        ignores.push_back(ignore);
+      else if (ignore.rfind("~/", 0) == 0 && home)
+        ignores.push_back(home + ignore.substr(1));
+      else
+        for (const auto &root : m_roots)
+          ignores.push_back((root.path / ignore).string());
+    }
+    m_paths.setIgnored(ignores);
+    m_ignoreDirs = ignores;
+    m_config.store(config.get(), std::memory_order_release);
+    m_configs.push_back(std::move(config));
+  }
+
+  // SIGHUP rereads the config file. The stream keeps running, and a broken
+  // file leaves the current rules in place.
+  void installReloadHandler() {
+    signal(SIGHUP, SIG_IGN);
+    dispatch_source_t source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_SIGNAL, SIGHUP, 0, m_eventQueue);
+    dispatch_source_set_event_handler(source, ^{
+      ++m_metrics.wakeups;
+      reloadConfig();
+    });
+    dispatch_resume(source);
+    m_signalSources.push_back(source);
+  }
+
+  // Must run on m_eventQueue.
+  void reloadConfig() {
+    std::unique_ptr<RuleConfig> config;
+    std::string error;
+    if (!loadConfig(config, error)) {
+      LOG_WARN("Config " << m_configPath << " not reloaded: " << error);
+      return;
+    }
+    if (config->spec() == this->config().spec()) {
+      LOG_DEBUG("Config " << m_configPath << " unchanged");
+      return;
+    }
+    size_t rules = config->ruleCount();
+    applyConfig(std::move(config));
+    LOG_INFO("Reloaded " << m_configPath << ": " << rules << " rules");
+    // Existing projects may match the new rules; find them with a
+    // throttled rescan instead of waiting for their next event
+    for (const auto &root : m_roots)
+      queueRescan(root.path.native(), "rules changed");
+  }
+
+  // --- Event ID Checkpointing ---
+
+  static std::string defaultCheckpointPath() {
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+      return "/tmp/asimov.watch.checkpoint";
+    return (fs::path(home) / "Library" / "Application Support" /
+            "asimov-watch" / "checkpoint")
+        .string();
+  }
+
+  static std::string deviceUUIDString(dev_t dev) {
+    CFUUIDRef uuid = FSEventsCopyUUIDForDevice(dev);
+    if (!uuid)
+      return "";
+    CFStringRef str = CFUUIDCreateString(NULL, uuid);
+    CFRelease(uuid);
+    if (!str)
+      return "";
+    char buf[64];
+    std::string result;
+    if (CFStringGetCString(str, buf, sizeof(buf), kCFStringEncodingUTF8))
+      result = buf;
+    CFRelease(str);
+    return result;
+  }
+
+  bool loadCheckpoint(Checkpoint &out) const {
+    std::ifstream in(m_checkpointPath);
+    if (!in.good())
+      return false;
+
+    std::string line;
+    bool haveEventId = false;
+    int version = 0;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string key;
+      fields >> key;
+      if (key == "version") {
+        fields >> version;
+      } else if (key == "root") {
+        CheckpointRoot root;
+        fields >> root.deviceUUID;
+        std::getline(fields >> std::ws, root.path);
+        out.roots.push_back(std::move(root));
+      } else if (key == "event") {
+        haveEventId = static_cast<bool>(fields >> out.eventId);
+      }
+    }
+    // Version 1 files described a single root with a separate uuid line;
+    // they simply don't match and cause one full scan
+    return version == 2 && haveEventId && !out.roots.empty();
+  }
+
+  // Must run on m_eventQueue.
+  void saveCheckpoint() {
+    if (!m_exclusions.modifiesFilesystem())
+      return; // Nothing was excluded, so there is no progress to keep
+    if (m_scanRunning || m_rescanRunning || !m_rescanPending.empty())
+      return; // An interrupted scan must be redone, so keep the old position
+    for (const auto &root : m_roots) {
+      if (root.deviceUUID.empty())
+        return;
+    }
+    if (m_shardWork != 0 || !m_exclusions.idle())
+      return; // Don't move past events whose exclusions haven't landed yet
+
+    // The index lives next to the checkpoint, so on a fresh install the
+    // directory has to exist before either is written
+    std::error_code ec;
+    fs::path target(m_checkpointPath);
+    fs::create_directories(target.parent_path(), ec);
+
+    // The index goes first: one newer than its checkpoint is rejected on
+    // load, one older would be missing changes.
+    FSEventStreamEventId eventId = m_lastEventId;
+    if (!m_index.save(m_indexPath, eventId)) {
+      LOG_WARN("Failed to write exclusion index " << m_indexPath);
+      return;
+    }
+
+    // Write-then-rename so a crash never leaves a torn checkpoint behind
+    std::string tmpPath = m_checkpointPath + ".tmp";
+    {
+      std::ofstream out(tmpPath, std::ios::trunc);
+      if (!out.good()) {
+        LOG_WARN("Failed to write checkpoint " << tmpPath);
+        return;
+      }
+      out << "version 2\n";
+      for (const auto &root : m_roots)
+        out << "root " << root.deviceUUID << " " << root.path.string()
+            << "\n";
+      out << "event " << eventId << "\n";
+      if (!out.flush().good())
+        return;
+    }
+    if (rename(tmpPath.c_str(), m_checkpointPath.c_str()) != 0) {
+      LOG_WARN("Failed to commit checkpoint " << m_checkpointPath);
+      return;
+    }
+    m_lastCheckpointSave = std::chrono::steady_clock::now();
+  }
+
+  // Decide where the stream starts. Replaying history is only safe when the
+  // checkpoint covers exactly these roots and none of their devices' event
+  // databases has been reset since (which changes its UUID).
+  FSEventStreamEventId resolveStartEventId() {
+    for (auto &root : m_roots) {
+      struct stat st;
+      if (stat(root.path.c_str(), &st) == 0)
+        root.deviceUUID = deviceUUIDString(st.st_dev);
+    }
+
+    Checkpoint cp;
+    if (!loadCheckpoint(cp))
+      return kFSEventStreamEventIdSinceNow;
+
+    bool sameRoots = cp.roots.size() == m_roots.size();
+    bool sameUUIDs = true;
+    for (size_t i = 0; sameRoots && i < m_roots.size(); ++i) {
+      sameRoots = cp.roots[i].path == m_roots[i].path.string();
+      sameUUIDs &= !m_roots[i].deviceUUID.empty() &&
+                   cp.roots[i].deviceUUID == m_roots[i].deviceUUID;
+    }
+
+    if (!sameRoots) {
+      LOG_DEBUG("Checkpoint is for other roots, ignoring");
+    } else if (!sameUUIDs) {
+      LOG_DEBUG("FSEvents database UUID changed, ignoring checkpoint");
+    } else if (cp.eventId > FSEventsGetCurrentEventId()) {
+      LOG_DEBUG("Checkpoint is ahead of the event database, ignoring");
+    } else {
+      LOG_DEBUG("Replaying FSEvents history since event " << cp.eventId);
+      m_replaying = true;
+      return cp.eventId;
+    }
+    return kFSEventStreamEventIdSinceNow;
+  }
+
+  // Returns true if the event only carried history bookkeeping and needs no
+  // further processing.
+  bool handleHistoryFlags(FSEventStreamEventFlags flags) {
+    // Also sent after a latency restart, which replays a few events
+    if (flags & kFSEventStreamEventFlagHistoryDone) {
+      if (m_replaying) {
+        m_replaying = false;
+        LOG_DEBUG("FSEvents history replay finished.");
+      }
+      return true;
+    }
+    if (!m_replaying)
+      return false;
+
+    // The kernel could not give us exact history: fall back to a full scan
+    constexpr FSEventStreamEventFlags historyLost =
+        kFSEventStreamEventFlagMustScanSubDirs |
+        kFSEventStreamEventFlagUserDropped |
+        kFSEventStreamEventFlagKernelDropped |
+        kFSEventStreamEventFlagEventIdsWrapped;
+    if (flags & historyLost) {
+      m_replaying = false;
+      startFullScan("event history incomplete");
+    }
+    return false;
+  }
+
+  // Must run on m_eventQueue.
+  void recordEventId(FSEventStreamEventId eventId) {
+    m_lastEventId = eventId;
+    saveCheckpointIfDue();
+  }
+
+  // Must run on m_eventQueue.
+  void saveCheckpointIfDue() {
+    if (std::chrono::steady_clock::now() - m_lastCheckpointSave >=
+        kCheckpointInterval)
+      saveCheckpoint();
+  }
+
+  // Must run on m_eventQueue.
+  void startFullScan(const char *reason) {
+    if (m_rescanRunning) {
+      m_fullScanDeferred = reason; // Started when the rescan is done
+      return;
+    }
+    if (m_scanRunning.exchange(true))
+      return;
+
+    LOG_DEBUG("Full scan required (" << reason << ")");
+    // Rebuilt by the scan; without exact history it may be stale
+    m_index.reset();
+    m_rescanPending.clear(); // Covered by the full scan
+    for (auto &owned : m_shards) {
+      EventShard *shard = owned.get();
+      dispatch_async(shard->queue, ^{
+        shard->missing.clear();
+      });
+    }
+    // Events keep their own queues; only the scan runs at the lower QoS
+    dispatch_async(m_scanThrottle.queue(), ^{
+      scanRoots();
+      m_scanRunning = false;
+      dispatch_async(m_eventQueue, ^{
+        saveCheckpoint();
+        noteActivity();
+      });
+    });
+  }
+
+  // Scans every root with one pool of workers. Blocks until done; returns
+  // the number of directories visited, details are in m_scanStats.
+  size_t scanRoots() {
+    std::vector<fs::path> roots;
+    for (const auto &root : m_roots)
+      roots.push_back(root.path);
+    return scanTrees(roots, "initial scan");
+  }
+
+  // Scans the trees below dirs with one pool of workers; the initial scan
+  // and subtree rescans differ only in where they start.
+  size_t scanTrees(const std::vector<fs::path> &dirs, const char *what) {
+    LOG_DEBUG("Starting " << what << " of " << dirs.size() << " tree(s) with "
+                          << m_scanThreads << " threads...");
+    auto started = std::chrono::steady_clock::now();
+    m_scanStats.reset();
+    ++m_metrics.scans;
+    WorkStealingScanner scanner(
+        m_scanThreads,
+        [this](const fs::path &dir, SubdirList &subdirs) {
+          scanDirectory(dir, subdirs);
+        },
+        &m_scanThrottle, m_scanMemory);
+    try {
+      scanner.run(dirs);
+    } catch (const std::exception &e) {
+      LOG_ERROR("Scan failed (" << what << "): " << e.what());
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - started;
+    uint64_t entries = m_scanStats.entries;
+    uint64_t syscalls = m_scanStats.syscalls;
+    m_scanStats.stackPeakBytes = scanner.peakStackBytes();
+    if (scanner.cappedSteals() || scanner.inPlaceDirectories())
+      LOG_DEBUG("Scan work stacks reached the memory cap, "
+                << scanner.cappedSteals() << " steals held back, "
+                << scanner.inPlaceDirectories()
+                << " directories walked in place");
+    LOG_DEBUG("Finished " << what << " in "
+              << std::fixed << std::setprecision(2) << elapsed.count() << "s ("
+              << scanner.directoriesVisited() << " directories, " << entries
+              << " entries, " << std::setprecision(3)
+              << (entries ? double(syscalls) / entries : 0.0)
+              << " syscalls/entry, " << m_scanStats.prunedTargets
+              << " dependency trees pruned, "
+              << m_scanStats.stackPeakBytes / 1024
+              << " KiB work stack peak).");
+    return scanner.directoriesVisited();
+  }
+
+  // --- Volumes ---
+
+  // Marks the mount points below the roots that the volume policy skips,
+  // plus file provider trees. Cheap and never blocks; runs at start and
+  // whenever FSEvents reports a mount or unmount.
+  void refreshVolumes() {
+    std::vector<std::string> skipped;
+    if (m_volumePolicy != VolumePolicy::All) {
+      for (const auto &root : m_roots) {
+        for (const char *dir : kFileProviderDirs)
+          skipped.push_back((root.path / dir).string());
+      }
+    }
+    struct stat st;
+    for (const auto &volume : mountedVolumes()) {
+      const WatchRoot *root = rootFor(volume.mountPoint);
+      if (!root || volume.mountPoint == root->path.native())
+        continue; // Not below a root; a root's own volume is always walked
+      dev_t rootDevice =
+          stat(root->path.c_str(), &st) == 0 ? st.st_dev : volume.device;
+      const char *reason = volumeSkipReason(volume, m_volumePolicy, rootDevice);
+      if (!reason)
+        continue;
+      if (m_skippedVolumes.insert(volume.mountPoint).second)
+        LOG_DEBUG("Skipping " << volume.mountPoint << " (" << volume.type
+                              << ", " << reason << ")");
+      skipped.push_back(volume.mountPoint);
+    }
+    m_paths.setSkippedVolumes(skipped);
+  }
+
+  // Roots on other volumes than the boot volume get a stream of their own
+  // with --device-streams, fed from the volume's own event database.
+  // Must run on m_eventQueue.
+  void startDeviceStreams() {
+    struct stat st;
+    if (!m_deviceStreamsEnabled || stat("/", &st) != 0)
+      return;
+    dev_t bootDevice = st.st_dev;
+    std::vector<Volume> volumes = mountedVolumes();
+    for (auto &root : m_roots) {
+      if (stat(root.path.c_str(), &st) != 0 || st.st_dev == bootDevice)
+        continue;
+      auto volume = std::find_if(
+          volumes.begin(), volumes.end(),
+          [&](const Volume &v) { return v.device == st.st_dev; });
+      if (volume == volumes.end())
+        continue;
+      root.deviceStream = true;
+
+      DeviceStream *device = nullptr;
+      for (auto &existing : m_deviceStreams) {
+        if (existing->device == st.st_dev)
+          device = existing.get();
+      }
+      if (!device) {
+        m_deviceStreams.push_back(std::make_unique<DeviceStream>());
+        device = m_deviceStreams.back().get();
+        device->watcher = this;
+        device->device = st.st_dev;
+        device->mountPoint = volume->mountPoint;
+      }
+      std::string relative = root.path.native().substr(
+          std::min(root.path.native().size(), device->mountPoint.size()));
+      device->relativePaths.push_back(relative.empty() ? "/" : relative);
+    }
+
+    for (auto &owned : m_deviceStreams) {
+      DeviceStream *device = owned.get();
+      std::vector<CFStringRef> paths;
+      for (const auto &path : device->relativePaths)
+        paths.push_back(CFStringCreateWithCString(NULL, path.c_str(),
+                                                  kCFStringEncodingUTF8));
+      CFArrayRef array = CFArrayCreate(NULL, (const void **)paths.data(),
+                                       paths.size(), &kCFTypeArrayCallBacks);
+      for (CFStringRef path : paths)
+        CFRelease(path);
+
+      FSEventStreamContext context = {0, (void *)device, NULL, NULL, NULL};
+      device->stream = FSEventStreamCreateRelativeToDevice(
+          NULL, &AsimovWatcher::deviceEventCallback, &context, device->device,
+          array, kFSEventStreamEventIdSinceNow, m_latency, streamFlags());
+      CFRelease(array);
+      FSEventStreamSetDispatchQueue(device->stream, m_eventQueue);
+      if (!FSEventStreamStart(device->stream)) {
+        LOG_WARN("Failed to start device stream for " << device->mountPoint);
+        continue;
+      }
+      LOG_DEBUG("Device stream for " << device->mountPoint);
+    }
+
+    // They start from now: whatever happened while we were away can only
+    // be found by walking, even when the main stream replays. Without a
+    // checkpoint the full scan covers them.
+    if (m_replaying) {
+      for (const auto &root : m_roots) {
+        if (root.deviceStream)
+          queueRescan(root.path.native(), "device stream");
+      }
+    }
+  }
+
+  // --- Subtree Rescans ---
+
+  // FSEvents lost or coalesced events below a directory, so anything
+  // created there meanwhile was never seen. Rather than a full scan, that
+  // one subtree is walked again. During replay the same flags already
+  // trigger a full scan, see handleHistoryFlags(). Must run on
+  // m_eventQueue.
+  void handleLostEvents(const char *path, FSEventStreamEventFlags flags) {
+    const char *reason;
+    if (flags & (kFSEventStreamEventFlagUserDropped |
+                 kFSEventStreamEventFlagKernelDropped))
+      reason = "events dropped"; // Path is the watched root
+    else if (flags & kFSEventStreamEventFlagMustScanSubDirs)
+      reason = "events coalesced";
+    else if (flags & kFSEventStreamEventFlagRootChanged)
+      reason = "root changed"; // Moved, deleted or recreated
+    else if (flags & kFSEventStreamEventFlagMount)
+      reason = "volume mounted";
+    else if (flags & kFSEventStreamEventFlagUnmount)
+      reason = nullptr;
+    else
+      return;
+
+    std::string_view dir(path);
+    while (dir.size() > 1 && dir.back() == '/')
+      dir.remove_suffix(1);
+    // A new volume may be one the policy skips, and then its rescan stops
+    // right at the mount point
+    if (flags & (kFSEventStreamEventFlagMount |
+                 kFSEventStreamEventFlagUnmount))
+      refreshVolumes();
+    if (!reason)
+      return;
+
+    // Clamped to the roots: a path inside one is rescanned as is, a path
+    // above some (e.g. "/" for a kernel drop) stands for every root below it
+    std::vector<std::string_view> dirs;
+    if (rootFor(dir)) {
+      dirs.push_back(dir);
+    } else {
+      std::string prefix(dir);
+      if (prefix.empty() || prefix.back() != '/')
+        prefix += '/';
+      for (const auto &root : m_roots) {
+        if (root.path.native().compare(0, prefix.size(), prefix) == 0)
+          dirs.push_back(root.path.native());
+      }
+    }
+    for (std::string_view rescan : dirs) {
+      // A root that was replaced may hold a different tree now; what we
+      // knew to be excluded in the old one no longer applies
+      if (flags & kFSEventStreamEventFlagRootChanged)
+        forgetExcluded(rescan);
+      queueRescan(rescan, reason);
+    }
+  }
+
+  // Must run on m_eventQueue.
+  void queueRescan(std::string_view dir, const char *reason) {
+    // Already covered by a pending rescan of dir or an ancestor?
+    for (size_t length = dir.size(); length > 1;) {
+      if (m_rescanPending.count(dir.substr(0, length)))
+        return;
+      size_t slash = dir.rfind('/', length - 1);
+      if (slash == std::string_view::npos || slash == 0)
+        break;
+      length = slash;
+    }
+    // ... and it covers every pending rescan below it
+    std::string below = std::string(dir) + '/';
+    auto it = m_rescanPending.lower_bound(below);
+    while (it != m_rescanPending.end() &&
+           it->compare(0, below.size(), below) == 0)
+      it = m_rescanPending.erase(it);
+    m_rescanPending.emplace(dir);
+
+    LOG_DEBUG("Rescan of " << dir << " queued (" << reason << ")");
+    scheduleRescan();
+  }
+
+  // Rescans run one batch at a time and at most once per kRescanInterval,
+  // so a storm that keeps losing events walks each affected subtree once
+  // per interval rather than once per drop. Must run on m_eventQueue.
+  void scheduleRescan() {
+    if (m_rescanScheduled || m_rescanRunning || m_rescanPending.empty())
+      return;
+    m_rescanScheduled = true;
+    auto now = std::chrono::steady_clock::now();
+    auto due = std::max(now + kRescanDelay, m_lastRescan + kRescanInterval);
+    runAfter(m_eventQueue, due - now, kRescanDelay / 2, ^{
+      m_rescanScheduled = false;
+      startRescan();
+    });
+  }
+
+  // Must run on m_eventQueue.
+  void startRescan() {
+    if (m_scanRunning) {
+      scheduleRescan(); // The full scan may cover it; check again later
+      return;
+    }
+    std::vector<std::string> dirs(m_rescanPending.begin(),
+                                  m_rescanPending.end());
+    m_rescanPending.clear();
+    if (dirs.empty())
+      return;
+    m_rescanRunning = true;
+    m_metrics.rescanTrees += dirs.size();
+
+    // Misses cached below them may predate the lost events. Exclusions
+    // are kept: an excluded tree needs no rescan.
+    for (auto &owned : m_shards) {
+      EventShard *shard = owned.get();
+      dispatch_async(shard->queue, ^{
+        for (const auto &dir : dirs)
+          shard->missing.eraseBelow(dir);
+      });
+    }
+    dispatch_async(m_scanThrottle.queue(), ^{
+      scanTrees(std::vector<fs::path>(dirs.begin(), dirs.end()), "rescan");
+      dispatch_async(m_eventQueue, ^{
+        m_rescanRunning = false;
+        m_lastRescan = std::chrono::steady_clock::now();
+        if (const char *reason = m_fullScanDeferred) {
+          m_fullScanDeferred = nullptr;
+          startFullScan(reason);
+        }
+        scheduleRescan();
+        saveCheckpoint();
+        noteActivity();
+      });
+    });
+  }
+
+  // launchd stops agents with SIGTERM; flush the stream position first so
+  // the next start only replays what we have not seen.
+  void installTerminationHandlers() {
+    for (int sig : {SIGTERM, SIGINT}) {
+      signal(sig, SIG_IGN);
+      dispatch_source_t source =
+          dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, sig, 0,
+                                 m_eventQueue);
+      dispatch_source_set_event_handler(source, ^{
+        // Shard queues are FIFO, so this also drains every queued batch
+        uint64_t coalesced = 0, evaluated = 0, probesSaved = 0;
+        for (auto &owned : m_shards) {
+          EventShard *shard = owned.get();
+          dispatch_sync(shard->queue, ^{
+            flushCandidates(*shard);
+          });
+          coalesced += shard->coalesced;
+          evaluated += shard->evaluated;
+          probesSaved += shard->probesSaved;
+        }
+        m_exclusions.flush();
+        saveCheckpoint();
+        LOG_DEBUG("Processed "
+                  << m_eventStats.events << " events, "
+                  << m_eventStats.filtered << " filtered with "
+                  << m_eventStats.filteredAllocations << " allocations, "
+                  << coalesced << " coalesced, " << evaluated
+                  << " targets evaluated, " << probesSaved
+                  << " probes answered from cache.");
+        LOG_DEBUG("Asimov Watcher stopping.");
+        exit(0);
+      });
+      dispatch_resume(source);
+      m_signalSources.push_back(source);
+    }
+  }
+
+  // --- Idle Mode ---
+
+  // dispatch_after() with an explicit leeway, so the kernel may fold the
+  // wakeup into one it has to do anyway. Every timer of the daemon goes
+  // through here and counts as a wakeup.
+  void runAfter(dispatch_queue_t queue, std::chrono::nanoseconds delay,
+                std::chrono::nanoseconds leeway, dispatch_block_t block) {
+    dispatch_source_t timer =
+        dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_timer(timer,
+                              dispatch_time(DISPATCH_TIME_NOW, delay.count()),
+                              DISPATCH_TIME_FOREVER, leeway.count());
+    dispatch_source_set_event_handler(timer, ^{
+      ++m_metrics.wakeups;
+      dispatch_source_cancel(timer);
+      block();
+    });
+    dispatch_source_set_cancel_handler(timer, ^{
+      dispatch_release(timer);
+    });
+    dispatch_resume(timer);
+  }
+
+  // Something worth watching happened: a relevant event, or a scan ended.
+  // Once nothing has for kIdleAfter, and no work is left anywhere, the
+  // daemon drops its caches and no timer is left: until FSEvents calls
+  // back it doesn't wake up at all. Must run on m_eventQueue.
+  void noteActivity() {
+    m_lastActivity = std::chrono::steady_clock::now();
+    if (m_idle) {
+      m_idle = false;
+      LOG_DEBUG("Leaving idle mode");
+    }
+    scheduleIdleCheck(kIdleAfter);
+  }
+
+  void scheduleIdleCheck(std::chrono::steady_clock::duration delay) {
+    if (m_idleCheckScheduled)
+      return;
+    m_idleCheckScheduled = true;
+    runAfter(m_eventQueue, delay, kIdleLeeway, ^{
+      m_idleCheckScheduled = false;
+      checkIdle();
+    });
+  }
+
+  // Must run on m_eventQueue.
+  void checkIdle() {
+    auto quiet = std::chrono::steady_clock::now() - m_lastActivity;
+    bool busy = m_scanRunning || m_rescanRunning || m_rescanScheduled ||
+                !m_rescanPending.empty() || m_shardWork > 0 ||
+                m_exclusions.pendingCount() > 0;
+    if (busy)
+      scheduleIdleCheck(kIdleAfter);
+    else if (quiet < kIdleAfter)
+      scheduleIdleCheck(kIdleAfter - quiet);
+    else if (!m_idle)
+      enterIdle();
+  }
+
+  // Everything dropped here is a cache that refills on demand. Must run on
+  // m_eventQueue, with no shard work in flight.
+  void enterIdle() {
+    m_idle = true;
+    ++m_metrics.idlePeriods;
+
+    // The index still knows every exclusion they cached
+    m_paths.clearExcluded();
+    for (auto &owned : m_shards) {
+      EventShard *shard = owned.get();
+      dispatch_sync(shard->queue, ^{
+        shard->missing.clear();
+        shard->dirFds.clear();
+      });
+    }
+    {
+      std::lock_guard<std::mutex> guard(m_spareBatchLock);
+      m_spareBatches.clear();
+    }
+    // Rules replaced by a reload: with the shards idle and no scan running
+    // nothing points into them any more
+    if (m_configs.size() > 1)
+      m_configs.erase(m_configs.begin(), m_configs.end() - 1);
+
+    // Hand the freed pages back to the system
+    size_t released = malloc_zone_pressure_relief(nullptr, 0);
+    LOG_DEBUG("Idle, caches dropped (" << released / 1024
+                                       << " KiB returned)");
+  }
+
+  // --- Metrics Endpoint ---
+
+  // SIGUSR1 logs one METRICS line; --metrics-socket serves the same JSON to
+  // anyone who connects. Both run on their own queue, so a stuck event
+  // queue still shows up in the numbers.
+  void installMetricsHandlers() {
+    m_metricsQueue = dispatch_queue_create("com.asimov.metrics", NULL);
+    signal(SIGUSR1, SIG_IGN);
+    dispatch_source_t source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_SIGNAL, SIGUSR1, 0, m_metricsQueue);
+    dispatch_source_set_event_handler(source, ^{
+      ++m_metrics.wakeups;
+      std::ostringstream line;
+      writeMetrics(line);
+      LOG_INFO("METRICS: " << line.str());
+    });
+    dispatch_resume(source);
+    m_metricsSources.push_back(source);
+
+    if (!m_metricsSocketPath.empty())
+      openMetricsSocket();
+  }
+
+  void openMetricsSocket() {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (m_metricsSocketPath.size() >= sizeof(addr.sun_path)) {
+      LOG_WARN("Metrics socket path too long: " << m_metricsSocketPath);
+      return;
+    }
+    std::memcpy(addr.sun_path, m_metricsSocketPath.c_str(),
+                m_metricsSocketPath.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(m_metricsSocketPath.c_str()); // Left over from a previous run
+    if (fd < 0 || bind(fd, (const sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 4) != 0) {
+      LOG_WARN("Failed to listen on " << m_metricsSocketPath);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    chmod(m_metricsSocketPath.c_str(), 0600);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); // A client may hang up before reading
+
+    dispatch_source_t source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_READ, fd, 0, m_metricsQueue);
+    dispatch_source_set_event_handler(source, ^{
+      ++m_metrics.wakeups;
+      int client = accept(fd, nullptr, nullptr);
+      if (client < 0)
+        return;
+      std::ostringstream out;
+      writeMetrics(out);
+      out << "\n";
+      std::string text = out.str();
+      writeFully(client, text.data(), text.size());
+      close(client);
+    });
+    dispatch_resume(source);
+    m_metricsSources.push_back(source);
+    LOG_DEBUG("Serving metrics on " << m_metricsSocketPath);
+  }
+
+  // One JSON object on one line. Safe on any thread: everything it reads
+  // is atomic or locked.
+  void writeMetrics(std::ostream &out) {
+    uint64_t coalesced = 0, evaluated = 0, ignored = 0, probes = 0,
+             probesSaved = 0;
+    for (const auto &shard : m_shards) {
+      coalesced += shard->coalesced;
+      evaluated += shard->evaluated;
+      ignored += shard->ignored;
+      probes += shard->probes + shard->listStats.syscalls;
+      probesSaved += shard->probesSaved;
+    }
+    const ExclusionQueue::Stats &exclusions = m_exclusions.stats();
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> uptime = now - m_started;
+    // Since the previous dump, which is what "how often does it wake up
+    // while idle" needs; the first dump covers the whole uptime
+    std::chrono::duration<double> sinceDump = now - m_dumpAt;
+    uint64_t wakeups = m_metrics.wakeups;
+    double wakeupRate = sinceDump.count() > 0
+                            ? (wakeups - m_dumpWakeups) / sinceDump.count()
+                            : 0;
+    m_dumpWakeups = wakeups;
+    m_dumpAt = now;
+
+    out << "{\"uptime_s\":" << std::fixed << std::setprecision(1)
+        << uptime.count() << ",\"events\":{\"callbacks\":"
+        << m_eventStats.callbacks << ",\"total\":" << m_eventStats.events
+        << ",\"filtered\":" << m_eventStats.filtered
+        << ",\"filtered_allocations\":" << m_eventStats.filteredAllocations
+        << ",\"below_excluded\":" << m_eventStats.belowExcluded
+        << ",\"urgent\":" << m_eventStats.urgent
+        << ",\"coalesced\":" << coalesced << ",\"evaluated\":" << evaluated
+        << ",\"ignored\":" << ignored << ",\"syscalls\":" << probes
+        << ",\"probes_saved\":" << probesSaved << "}"
+        << ",\"parent_excluded\":{\"calls\":"
+        << m_metrics.parentExcludedCalls
+        << ",\"xattr_probes\":" << m_metrics.parentExcludedProbes << "}"
+        << ",\"exclusions\":{\"requested\":" << exclusions.requested
+        << ",\"queued\":" << exclusions.queued
+        << ",\"already_excluded\":" << exclusions.alreadyExcluded
+        << ",\"excluded\":" << exclusions.excluded
+        << ",\"failed\":" << exclusions.failed
+        << ",\"pending\":" << m_exclusions.pendingCount() << "}"
+        << ",\"scan\":{\"running\":" << (m_scanRunning ? "true" : "false")
+        << ",\"scans\":" << m_metrics.scans
+        << ",\"rescan_trees\":" << m_metrics.rescanTrees
+        << ",\"directories\":" << m_scanStats.directories
+        << ",\"entries\":" << m_scanStats.entries
+        << ",\"syscalls\":" << m_scanStats.syscalls
+        << ",\"pruned_targets\":" << m_scanStats.prunedTargets
+        << ",\"stack_peak_kb\":" << m_scanStats.stackPeakBytes / 1024
+        << ",\"throttled_ms\":" << m_scanThrottle.throttledMs()
+        << ",\"paused_ms\":" << m_scanThrottle.pausedMs() << "}"
+        << ",\"power\":{\"idle\":" << (m_idle ? "true" : "false")
+        << ",\"idle_periods\":" << m_metrics.idlePeriods
+        << ",\"wakeups\":" << wakeups << ",\"wakeups_per_s\":"
+        << std::setprecision(3) << wakeupRate << std::setprecision(1) << "}"
+        << ",\"checkpoint\":{\"event_id\":" << m_lastEventId
+        << ",\"shard_work\":" << m_shardWork << "}"
+        << ",\"latency\":{\"callback\":";
+    m_metrics.callback.writeJson(out);
+    out << ",\"shard_lag\":";
+    m_metrics.shardLag.writeJson(out);
+    out << ",\"parent_excluded\":";
+    m_metrics.parentExcluded.writeJson(out);
+    out << ",\"exclusion_backend\":";
+    exclusions.backend.writeJson(out);
+    out << ",\"scan_directory\":";
+    m_metrics.scanDirectory.writeJson(out);
+    out << ",\"event_to_queue\":";
+    m_metrics.eventToQueue.writeJson(out);
+    out << ",\"end_to_end\":";
+    exclusions.endToEnd.writeJson(out);
+    out << "}}";
+  }
+
+  // --- Core Logic ---
+
+  // Classifies one FSEvents path. Returns true if the event was handed on:
+  // its name is a sentinel or target, or it removed a directory whose
+  // cached state has to go. Every other event leaves before touching the
+  // filesystem or the heap.
+  //
+  // Relevant events are not evaluated here. They are handed to their
+  // shard, which turns them into candidate targets that are checked once
+  // per debounce window, see flushCandidates().
+  bool checkPath(const char *path, FSEventStreamEventFlags flags,
+                 const EventTrace &trace) {
+    std::string_view pathView(path);
+    bool isCreated = (flags & kFSEventStreamEventFlagItemCreated);
+    bool isRenamed = (flags & kFSEventStreamEventFlagItemRenamed);
+    bool isRemoved = (flags & kFSEventStreamEventFlagItemRemoved);
+
+    // A removed or moved directory takes its cached exclusion with it
+    bool isDir = (flags & kFSEventStreamEventFlagItemIsDir);
+    bool forwarded = false;
+    if ((isRemoved || isRenamed) && isDir &&
+        !(m_paths.classify(pathView) &
+          (PathTrie::kIgnored | PathTrie::kSkippedVolume))) {
+      forgetExcluded(pathView);
+      queueRemoval(pathView);
+      forwarded = true;
+    }
+
+    if (!isCreated && !isRenamed)
+      return forwarded;
+
+    size_t slash = pathView.rfind('/');
+    if (slash == std::string_view::npos || slash == 0)
+      return forwarded;
+    std::string_view parent = pathView.substr(0, slash);
+    std::string_view filename = pathView.substr(slash + 1);
+    const ConfigRuleTable &table = config().table();
+    const RuleName *ruleName = table.find(filename);
+    if (!ruleName)
+      return forwarded;
+
+    // Inside a directory that is excluded or about to be: whatever this
+    // event could find goes with it
+    if (m_paths.classify(parent) &
+        (PathTrie::kExcluded | PathTrie::kExcluding)) {
+      ++m_eventStats.belowExcluded;
+      return forwarded;
+    }
+
+    // Only a plain creation proves the sentinel is there; renames and
+    // removals in the same batch still need a probe
+    bool sentinelSeen = isCreated && !isRenamed && !isRemoved;
+
+    // Sharded by the parent, so a sentinel lands next to its target
+    queueEvent(parent,
+               {pathView, ShardEvent::kRuleName, ruleName, sentinelSeen,
+                trace},
+               !insideTarget(table, parent));
+    return true;
+  }
+
+  // Whether a component of dir below its root names a rule target, e.g.
+  // dir is somewhere inside a node_modules.
+  bool insideTarget(const ConfigRuleTable &table, std::string_view dir) const {
+    if (const WatchRoot *root = rootFor(dir))
+      dir.remove_prefix(std::min(dir.size(), root->prefix.size()));
+    while (!dir.empty()) {
+      size_t slash = dir.find('/');
+      if (const RuleName *ruleName = table.find(dir.substr(0, slash))) {
+        for (uint8_t i = 0; i < ruleName->refCount; ++i) {
+          if (!ruleName->refs[i].isSentinel)
+            return true;
+        }
+      }
+      if (slash == std::string_view::npos)
+        break;
+      dir.remove_prefix(slash + 1);
+    }
+    return false;
+  }
+
+  // Directory-level mode: the event names a directory whose contents
+  // changed. It is listed once per debounce window, however many events it
+  // got.
+  bool checkDirectory(const char *path, const EventTrace &trace) {
+    std::string_view dir(path);
+    while (dir.size() > 1 && dir.back() == '/')
+      dir.remove_suffix(1);
+    if (dir.empty())
+      return false;
+
+    if (m_paths.classify(dir) &
+        (PathTrie::kIgnored | PathTrie::kExcluded | PathTrie::kExcluding |
+         PathTrie::kSkippedVolume))
+      return false;
+
+    queueEvent(dir, {dir, ShardEvent::kDirectory, nullptr, false, trace},
+               !insideTarget(config().table(), dir));
+    return true;
+  }
+
+  // --- Watch Roots ---
+
+  // Registers the roots with their ignore lists. A root inside another one
+  // is folded into it: the outer root already sees all of its events, and
+  // scanning both would walk the inner tree twice.
+  void addRoots(const std::vector<RootOptions> &roots) {
+    std::vector<std::string> paths;
+    for (const auto &root : roots) {
+      std::string path = root.path;
+      while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+      paths.push_back(path);
+    }
+    std::vector<std::string> sorted = paths;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    for (const auto &path : sorted) {
+      if (const WatchRoot *outer = rootFor(path)) {
+        LOG_WARN(path << " is inside " << outer->path.string()
+                      << ", watching it through that root");
         continue;
+      }
+      WatchRoot root;
+      root.path = path;
+      root.prefix = path.back() == '/' ? path : path + '/';
+      m_roots.push_back(std::move(root));
+    }
 
-      // Construct absolute path: watchRoot / ignoreDir
-      fs::path absPath = m_watchRoot / ignoreDir;
-      std::string absPathStr = absPath.string();
+    // Absolute ignore paths, so ignores of every root share one trie
+    for (size_t i = 0; i < roots.size(); ++i) {
+      for (const auto &ignoreDir : roots[i].ignores) {
+        if (ignoreDir.empty())
+          continue;
 
-      // Ensure the path string ends with a separator for robust prefix matching
-      // unless it's the root itself (unlikely for an ignore rule)
-      if (absPathStr.back() != fs::path::preferred_separator) {
-        absPathStr += fs::path::preferred_separator;
+        // Construct absolute path: root / ignoreDir. The trie matches
+        // whole components, so "Library" never swallows "Library2".
+        std::string absPathStr = (fs::path(paths[i]) / ignoreDir).string();
+        m_rootIgnores.push_back(absPathStr);
       }
+    }
+  }
 
-      m_absoluteIgnorePrefixes.push_back(absPathStr);
+  // The root a path belongs to, or null if it is outside all of them.
+  const WatchRoot *rootFor(std::string_view path) const {
+    for (const auto &root : m_roots) {
+      if (path == root.path.native() ||
+          path.compare(0, root.prefix.size(), root.prefix) == 0)
+        return &root;
     }
+    return nullptr;
   }
 
-  void run() {
-    std::cout << "DEBUG: Asimov Watcher started on " << m_watchRoot.string()
-              << std::endl;
-    std::cout << "DEBUG: Ignoring directories: ";
-    for (const auto &dir : m_absoluteIgnorePrefixes)
-      std::cout << dir << ", ";
-    std::cout << std::endl;
-
-    // 1. Initial Scan (Async background)
-    dispatch_async(
-        dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-          std::cout << "DEBUG: Starting initial scan..." << std::endl;
-          try {
-            scanRecursive(m_watchRoot);
-          } catch (const std::exception &e) {
-            std::cerr << "ERROR: Initial scan failed: " << e.what()
-                      << std::endl;
-          }
-          std::cout << "DEBUG: Initial scan finished." << std::endl;
-        });
+  // --- Event Shards ---
 
-    // 2. Start FSEvents Monitor
-    dispatch_queue_t queue = dispatch_queue_create("com.asimov.fsevents", NULL);
+  void createShards() {
+    m_shards.reserve(m_shardCount);
+    for (unsigned i = 0; i < m_shardCount; ++i) {
+      std::string label = "com.asimov.events." + std::to_string(i);
+      auto shard = std::make_unique<EventShard>();
+      shard->queue = dispatch_queue_create(label.c_str(), NULL);
+      m_shards.push_back(std::move(shard));
+    }
+    m_batches.resize(m_shardCount * kLanes, nullptr);
+  }
 
-    std::string pathStr = m_watchRoot.string();
-    CFStringRef mypath =
-        CFStringCreateWithCString(NULL, pathStr.c_str(), kCFStringEncodingUTF8);
-    CFArrayRef pathsToWatch =
-        CFArrayCreate(NULL, (const void **)&mypath, 1, NULL);
+  // The first kShardDepth components of dir below its root, so the same
+  // relative project in two roots may share a shard. The root itself and
+  // anything outside the roots hash as a whole. wholeSubtree tells whether
+  // everything below dir maps to the same key.
+  std::string_view shardKey(std::string_view dir, bool &wholeSubtree) const {
+    wholeSubtree = false;
+    const WatchRoot *root = rootFor(dir);
+    if (!root || dir.size() <= root->prefix.size())
+      return dir;
+    dir.remove_prefix(root->prefix.size());
 
-    // Pass 'this' instance to the C-style callback
-    FSEventStreamContext context = {0, (void *)this, NULL, NULL, NULL};
+    size_t pos = 0;
+    for (unsigned depth = 1; depth < kShardDepth; ++depth) {
+      pos = dir.find('/', pos);
+      if (pos == std::string_view::npos)
+        return dir;
+      ++pos;
+    }
+    wholeSubtree = true;
+    return dir.substr(0, dir.find('/', pos));
+  }
+
+  size_t shardFor(std::string_view dir) const {
+    bool wholeSubtree;
+    return std::hash<std::string_view>()(shardKey(dir, wholeSubtree)) %
+           m_shardCount;
+  }
 
-    FSEventStreamRef stream = FSEventStreamCreate(
-        NULL, &AsimovWatcher::fsEventCallbackWrapper, &context, pathsToWatch,
-        kFSEventStreamEventIdSinceNow,
-        1.0, // Latency
-        kFSEventStreamCreateFlagFileEvents);
+  // Copies the event's path into the shard's batch; the callback's own
+  // paths are gone once it returns. Must run on m_eventQueue.
+  void queueEvent(std::string_view shardDir, ShardEvent event, bool urgent) {
+    queueEvent(shardFor(shardDir), event, urgent);
+  }
 
-    FSEventStreamSetDispatchQueue(stream, queue);
+  void queueEvent(size_t shard, ShardEvent event, bool urgent = false) {
+    if (urgent)
+      ++m_eventStats.urgent;
+    if (event.kind != ShardEvent::kRemoved)
+      ++m_queuedEvents;
+    ShardBatch *&batch =
+        m_batches[shard * kLanes + (urgent ? kUrgentLane : kNormalLane)];
+    if (!batch)
+      batch = acquireBatch();
+    event.path = batch->paths.store(event.path);
+    batch->events.push_back(event);
+  }
 
-    if (!FSEventStreamStart(stream)) {
-      std::cerr << "ERROR: Failed to start FSEvent stream" << std::endl;
-      exit(1);
+  // Cached state below dir may live in any shard that owns part of its
+  // subtree; that is one shard unless dir is close to a root.
+  void queueRemoval(std::string_view dir) {
+    bool wholeSubtree;
+    std::string_view key = shardKey(dir, wholeSubtree);
+    ShardEvent event{dir, ShardEvent::kRemoved, nullptr, false, {}};
+    if (wholeSubtree) {
+      queueEvent(std::hash<std::string_view>()(key) % m_shardCount, event);
+      return;
     }
+    for (size_t shard = 0; shard < m_shardCount; ++shard)
+      queueEvent(shard, event);
+  }
 
-    // Keep main thread alive
-    dispatch_main();
+  ShardBatch *acquireBatch() {
+    std::lock_guard<std::mutex> guard(m_spareBatchLock);
+    if (m_spareBatches.empty())
+      return new ShardBatch();
+    ShardBatch *batch = m_spareBatches.back().release();
+    m_spareBatches.pop_back();
+    return batch;
   }
 
-private:
-  fs::path m_watchRoot; // Optimized: Store as fs::path
-  std::vector<Rule> m_sentinels;
-  std::vector<std::string> m_absoluteIgnorePrefixes;
+  // Keeps up to two batches per lane, one being filled while the other
+  // one runs.
+  void recycleBatch(ShardBatch *batch) {
+    std::unique_ptr<ShardBatch> owned(batch);
+    owned->events.clear();
+    owned->paths.reset();
+    std::lock_guard<std::mutex> guard(m_spareBatchLock);
+    if (m_spareBatches.size() < 2 * size_t(m_shardCount) * kLanes)
+      m_spareBatches.push_back(std::move(owned));
+  }
 
-  // --- Static Callback Wrapper ---
-  static void fsEventCallbackWrapper(ConstFSEventStreamRef streamRef,
-                                     void *clientCallBackInfo, size_t numEvents,
-                                     void *eventPaths,
-                                     const FSEventStreamEventFlags eventFlags[],
-                                     const FSEventStreamEventId eventIds[]) {
-    // SAFETY: Prevent C++ exceptions from unwinding into C stack frames
-    try {
-      AsimovWatcher *watcher = static_cast<AsimovWatcher *>(clientCallBackInfo);
-      char **paths = (char **)eventPaths;
-      for (size_t i = 0; i < numEvents; i++) {
-        watcher->checkPath(paths[i], false, eventFlags[i]);
+  // Hands every batch filled by the current callback to its shard's lane.
+  // Must run on m_eventQueue.
+  void dispatchBatches() {
+    auto queued = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < m_batches.size(); ++i) {
+      ShardBatch *batch = m_batches[i];
+      if (!batch)
+        continue;
+      m_batches[i] = nullptr;
+
+      EventShard *shard = m_shards[i / kLanes].get();
+      batch->queued = queued;
+      {
+        std::lock_guard<std::mutex> guard(shard->laneLock);
+        shard->lanes[i % kLanes].push_back(batch);
       }
-    } catch (const std::exception &e) {
-      std::cerr << "ERROR: Exception in FSEvents callback: " << e.what()
-                << std::endl;
-    } catch (...) {
-      std::cerr << "ERROR: Unknown exception in FSEvents callback" << std::endl;
+      ++m_shardWork;
+      dispatch_async(shard->queue, ^{
+        runNextBatch(*shard);
+      });
     }
   }
 
-  // --- Core Logic ---
-
-  void checkPath(const fs::path &path, bool parentVerified = false,
-                 FSEventStreamEventFlags flags = kFSEventStreamEventFlagNone,
-                 bool skipExclusionCheck = false) {
-    // Optimization: Filter based on flags if available
-    if (flags != kFSEventStreamEventFlagNone) {
-      bool isCreated = (flags & kFSEventStreamEventFlagItemCreated);
-      bool isRenamed = (flags & kFSEventStreamEventFlagItemRenamed);
+  // Runs one batch per dispatched block, but not necessarily the one the
+  // block was dispatched for: urgent batches overtake the normal ones
+  // still waiting. Must run on the shard's queue.
+  void runNextBatch(EventShard &shard) {
+    ShardBatch *batch;
+    {
+      std::lock_guard<std::mutex> guard(shard.laneLock);
+      std::deque<ShardBatch *> &lane = shard.lanes[kUrgentLane].empty()
+                                           ? shard.lanes[kNormalLane]
+                                           : shard.lanes[kUrgentLane];
+      batch = lane.front();
+      lane.pop_front();
+    }
+    m_metrics.shardLag.record(std::chrono::steady_clock::now() -
+                              batch->queued);
+    processBatch(shard, batch->events);
+    recycleBatch(batch);
+    finishShardWork();
+  }
 
-      if (!isCreated && !isRenamed) {
-        return;
+  // Must run on the shard's queue.
+  void processBatch(EventShard &shard, const std::vector<ShardEvent> &batch) {
+    uint64_t allocationsBefore = t_allocations;
+    uint64_t probesBefore = t_probes;
+    for (const auto &event : batch) {
+      switch (event.kind) {
+      case ShardEvent::kRuleName:
+        coalescePath(shard, event);
+        break;
+      case ShardEvent::kDirectory:
+        coalesceDirectory(shard, event.path, event.trace);
+        break;
+      case ShardEvent::kRemoved:
+        shard.missing.eraseBelow(event.path);
+        break;
       }
+    }
+    shard.allocations += t_allocations - allocationsBefore;
+    shard.probes += t_probes - probesBefore;
+    if (shard.flushScheduled && m_debounceMs == 0)
+      flushCandidates(shard);
+  }
+
+  // Once the last piece of shard work is done the checkpoint may move
+  // again; don't wait for the next event to find out.
+  void finishShardWork() {
+    if (m_shardWork.fetch_sub(1) == 1)
+      dispatch_async(m_eventQueue, ^{
+        saveCheckpointIfDue();
+      });
+  }
+
+  // --- Event Coalescing ---
+
+  // Must run on the shard's queue.
+  void coalescePath(EventShard &shard, const ShardEvent &event) {
+    std::string_view path = event.path;
+    shard.missing.erase(path); // It was just created or moved here
+
+    // Everything strictly below a pending target is decided by that target
+    // (e.g. the thousands of nested package.json of a fresh node_modules).
+    // The target itself is not: the pending entry may be there for another
+    // rule, so this event's rules still have to be added to it.
+    std::string_view parent(path.data(), path.rfind('/'));
+    if (shard.pendingTrie.lookup(parent) & PathTrie::kPending) {
+      ++shard.coalesced;
+      return;
+    }
+
+    // Candidate paths are built in a reused buffer instead of fs::path
+    // temporaries
+    thread_local std::string target;
+    const RuleName &ruleName = *event.ruleName;
+    for (uint8_t i = 0; i < ruleName.refCount; ++i) {
+      const RuleRef &ref = ruleName.refs[i];
+      // Found Sentinel (e.g. package.json)? -> Candidate is the sibling
+      // target (node_modules). Found Target? -> Candidate is the path itself.
+      if (ref.isSentinel)
+        buildSibling(target, parent, ref.rule->value);
+      else
+        target = path;
+      addCandidate(shard, target, ref.rule,
+                   ref.isSentinel && event.sentinelSeen, event.trace);
+    }
+  }
+
+  // Must run on the shard's queue.
+  void coalesceDirectory(EventShard &shard, std::string_view dir,
+                         const EventTrace &trace) {
+    // Only a directory that wasn't pending yet costs a copy
+    thread_local std::string key;
+    key.assign(dir.data(), dir.size());
+    auto pending = shard.pendingDirs.emplace(key, trace);
+    if (pending.second) {
+      scheduleFlush(shard);
+    } else {
+      pending.first->second.merge(trace);
+      ++shard.coalesced;
+    }
+  }
+
+  void addCandidate(EventShard &shard, const std::string &target,
+                    const Rule *rule, bool sentinelSeen,
+                    const EventTrace &trace) {
+    auto it = shard.pendingTargets.find(target);
+    if (it == shard.pendingTargets.end()) {
+      it = shard.pendingTargets.emplace(target, PendingTarget()).first;
+      shard.pendingTrie.mark(target, PathTrie::kPending);
+    }
 
-      // Special handling for Rename: FSEvents reports both source and dest.
-      // Source does not exist, Destination does.
-      if (isRenamed && !fs::exists(path)) {
+    for (auto &pending : it->second) {
+      if (pending.rule == rule) {
+        pending.sentinelSeen |= sentinelSeen;
+        pending.trace.merge(trace);
+        ++shard.coalesced;
         return;
       }
     }
+    it->second.push_back({rule, sentinelSeen, trace});
+    scheduleFlush(shard);
+  }
 
-    // Optimizations
-    if (!skipExclusionCheck) {
-      if (shouldIgnore(path))
-        return;
+  void scheduleFlush(EventShard &shard) {
+    if (shard.flushScheduled)
+      return;
+    shard.flushScheduled = true;
+    ++m_shardWork;
+    if (m_debounceMs == 0)
+      return; // Flushed at the end of the current batch
+    EventShard *target = &shard;
+    std::chrono::milliseconds debounce(m_debounceMs);
+    runAfter(shard.queue, debounce, debounce / 4, ^{
+      flushCandidates(*target);
+    });
+  }
 
-      // If parent is not verified by caller, we must check up the tree
-      if (!parentVerified && isParentExcluded(path))
-        return;
+  // Must run on the shard's queue. A timer that fires after an early flush
+  // (e.g. at shutdown) finds nothing to do.
+  void flushCandidates(EventShard &shard) {
+    bool scheduled = shard.flushScheduled;
+    shard.flushScheduled = false;
+    uint64_t allocationsBefore = t_allocations;
+    uint64_t probesBefore = t_probes;
 
-      // Even if parent is verified, we must check if THIS specific directory is
-      // excluded
-      if (parentVerified && isExcludedFast(path.c_str()))
-        return;
+    if (!shard.pendingTargets.empty()) {
+      std::unordered_map<std::string, PendingTarget> pending;
+      pending.swap(shard.pendingTargets);
+      shard.pendingTrie.clearAll(PathTrie::kPending);
+
+      // Shallow first: once a project's node_modules is excluding, the
+      // candidates nested in it are skipped without a probe
+      using Candidate = std::pair<size_t, decltype(pending.cbegin())>;
+      std::vector<Candidate> order;
+      order.reserve(pending.size());
+      for (auto it = pending.cbegin(); it != pending.cend(); ++it)
+        order.emplace_back(std::count(it->first.begin(), it->first.end(), '/'),
+                           it);
+      std::sort(order.begin(), order.end(),
+                [](const Candidate &a, const Candidate &b) {
+                  return a.first < b.first;
+                });
+      for (const auto &candidate : order)
+        evaluateCandidate(shard, candidate.second->first,
+                          candidate.second->second);
     }
 
-    std::string filename = path.filename().string();
-    if (path.has_parent_path()) {
-      fs::path parent = path.parent_path();
+    if (!shard.pendingDirs.empty()) {
+      // Parents first, so a target found in one listing saves listing
+      // anything below it
+      std::vector<std::pair<std::string, EventTrace>> dirs(
+          shard.pendingDirs.begin(), shard.pendingDirs.end());
+      shard.pendingDirs.clear();
+      std::sort(dirs.begin(), dirs.end(),
+                [](const auto &a, const auto &b) { return a.first < b.first; });
 
-      // Combined Sentinel & Target Logic
-      for (const auto &rule : m_sentinels) {
-        // 1. Found Sentinel (e.g. package.json)? -> Check corresponding Target
-        // (node_modules)
-        if (filename == rule.key) {
-          fs::path target = parent / rule.value;
-          if (fs::exists(target))
-            applyExclusion(target);
-        }
-        // 2. Found Target (e.g. node_modules)? -> Check corresponding Sentinel
-        // (package.json)
-        else if (filename == rule.value) {
-          fs::path sentinel = parent / rule.key;
-          if (fs::exists(sentinel))
-            applyExclusion(path);
-        }
+      PathTrie found;
+      for (const auto &dir : dirs) {
+        if (found.lookup(dir.first) & PathTrie::kPending)
+          continue;
+        evaluateDirectory(shard, dir.first, found, dir.second);
       }
     }
+
+    shard.dirFds.clear();
+    shard.allocations += t_allocations - allocationsBefore;
+    shard.probes += t_probes - probesBefore;
+    if (scheduled)
+      finishShardWork();
   }
 
-  void scanRecursive(const fs::path &basePath) {
-    // Optimization: verifying the current directory (and aborting if excluded)
-    // is sufficient since we recurse top-down.
-    if (isExcludedFast(basePath.c_str()))
+  // Lists a changed directory and excludes the targets that sit next to
+  // their sentinel, exactly like the scanner does for each directory.
+  void evaluateDirectory(EventShard &shard, const std::string &dir,
+                         PathTrie &found, const EventTrace &trace) {
+    ++shard.evaluated;
+    if (ignoredByGlob(dir) || isParentExcluded(shard.dirFds, dir))
       return;
-    if (shouldIgnore(basePath))
+
+    // Usually still open from isParentExcluded()
+    int fd = shard.dirFds.open(dir, true);
+    if (fd < 0) {
+      if (errno == ENOENT)
+        forgetExcluded(dir);
+      return;
+    }
+    thread_local std::vector<DirEntry> entries;
+    thread_local std::vector<uint16_t> targetRule;
+    if (!BulkDirectoryReader::list(fd, dir, entries, shard.listStats))
       return;
+    forgetVanishedChildren(dir, entries);
+    matchTargets(entries, targetRule);
 
-    // Check the directory itself
-    checkPath(basePath, true, kFSEventStreamEventFlagNone,
-              true); // Verified locally
+    thread_local std::string target;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (!targetRule[i])
+        continue;
+      buildSibling(target, dir, entries[i].name);
+      found.mark(target, PathTrie::kPending);
+      applyExclusion(target, trace);
+    }
+  }
 
-    std::error_code ec;
-    fs::directory_iterator it(basePath, ec);
-    if (ec) {
-      // Permission denied or other error, just skip
+  // Directory-level events carry no per-item removed or renamed flags, so
+  // checkPath() never forgets anything for them. Instead, a cached
+  // exclusion below dir whose directory is no longer in the listing is
+  // dropped here; otherwise a directory recreated at the same path would
+  // pass for already excluded.
+  void forgetVanishedChildren(const std::string &dir,
+                              const std::vector<DirEntry> &entries) {
+    thread_local std::vector<std::string> cached;
+    cached.clear();
+    m_paths.excludedChildren(dir, cached);
+    m_index.excludedChildren(dir, cached);
+    if (cached.empty())
+      return; // The usual case: a few searches, no allocation
+    std::unordered_set<std::string_view> present;
+    for (const auto &entry : entries) {
+      if (entry.type == EntryType::Directory)
+        present.insert(entry.name);
+    }
+    thread_local std::string child;
+    for (const auto &name : cached) {
+      if (present.count(name))
+        continue;
+      buildSibling(child, dir, name);
+      LOG_DEBUG("Forgetting exclusion of vanished " << child);
+      forgetExcluded(child);
+    }
+  }
+
+  // One existence probe for the target, one per unconfirmed sentinel.
+  void evaluateCandidate(EventShard &shard, const std::string &target,
+                         const PendingTarget &rules) {
+    ++shard.evaluated;
+
+    // One trie walk answers both "ignored?" and "inside a directory we
+    // already know is excluded?"
+    PathTrie::Marks marks = m_paths.classify(target);
+    bool ignored = (marks & (PathTrie::kIgnored | PathTrie::kSkippedVolume)) ||
+                   ignoredByGlob(target);
+    if (ignored)
+      ++shard.ignored;
+    if (ignored || (marks & (PathTrie::kExcluded | PathTrie::kExcluding)))
+      return;
+    if (!probeExists(shard, target))
+      return;
+    if (isParentExcluded(shard.dirFds, target))
       return;
+
+    std::string_view parent(target.data(), target.rfind('/'));
+    thread_local std::string sentinel;
+    for (const auto &pending : rules) {
+      if (!pending.sentinelSeen) {
+        buildSibling(sentinel, parent, pending.rule->key);
+        if (!probeExists(shard, sentinel))
+          continue;
+      }
+      // Timed from the target's oldest event, whichever rule it came for
+      EventTrace trace;
+      for (const auto &rule : rules)
+        trace.merge(rule.trace);
+      applyExclusion(target, trace);
+      return; // One sentinel is enough
     }
+  }
 
-    for (const auto &entry : it) {
-      if (entry.is_directory()) {
-        scanRecursive(entry.path());
-      } else if (entry.is_regular_file()) {
-        checkPath(entry.path(), true); // Parent (basePath) is verified
+  // Scans a single directory for the parallel scanner. Subdirectories are
+  // handed back instead of recursed into so the workers can share them.
+  //
+  // Sentinel/target pairs are matched against the directory listing itself:
+  // a target next to its sentinel is excluded right here and never
+  // descended into, since everything below it is about to be excluded
+  // anyway.
+  void scanDirectory(const fs::path &basePath, SubdirList &subdirs) {
+    size_t listed;
+    {
+      ScopedLatency timer(m_metrics.scanDirectory);
+      ++m_scanStats.directories;
+      uint64_t allocationsBefore = t_allocations;
+      listed = scanDirectoryEntries(basePath, subdirs);
+      m_scanStats.allocations += t_allocations - allocationsBefore;
+    }
+    // Outside the timer: waiting for budget isn't time spent scanning
+    m_scanThrottle.pace(listed);
+  }
+
+  // Returns the number of entries listed.
+  size_t scanDirectoryEntries(const fs::path &basePath, SubdirList &subdirs) {
+    // Optimization: verifying the current directory (and aborting if excluded)
+    // is sufficient since we descend top-down.
+    if (m_index.covering(basePath.native())) {
+      m_paths.markExcluded(basePath.native());
+      return 0;
+    }
+    // Before the xattr read, so a skipped volume is never touched
+    if (shouldIgnore(basePath))
+      return 0;
+
+    // Opened relative to the parent, which the worker usually visited just
+    // before; the xattr read and the listing share the descriptor. Scan
+    // workers are threads of their own, so the cache closes with them.
+    thread_local DirFdCache fds(kScanFdCache);
+    uint64_t probesBefore = t_probes;
+    int fd = fds.open(basePath.native(), true);
+    bool excluded =
+        fd >= 0 ? isExcludedFd(fd) : isExcludedFast(basePath.c_str());
+    m_scanStats.syscalls += t_probes - probesBefore;
+    if (excluded) {
+      rememberExcluded(basePath.native());
+      return 0;
+    }
+    if (fd < 0)
+      return 0; // Permission denied or other error, just skip
+
+    thread_local std::vector<DirEntry> entries;
+    if (!BulkDirectoryReader::list(fd, basePath.native(), entries,
+                                   m_scanStats))
+      return 0;
+
+    thread_local std::vector<uint16_t> targetRule;
+    matchTargets(entries, targetRule);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const DirEntry &entry = entries[i];
+      if (entry.type != EntryType::Directory)
+        continue;
+      if (isPrunedName(entry.name))
+        continue;
+
+      if (targetRule[i]) {
+        thread_local std::string target;
+        buildSibling(target, basePath.native(), entry.name);
+        if (m_auditing)
+          recordAuditTarget(target, targetRule[i] - 1);
+        applyExclusion(target);
+        ++m_scanStats.prunedTargets;
+        continue;
       }
+      subdirs.add(basePath.native(), entry.name);
+    }
+
+    size_t listed = entries.size();
+    // Keep the buffers one huge directory grew from staying that big
+    if (entries.capacity() > kKeepEntries) {
+      std::vector<DirEntry>().swap(entries);
+      std::vector<uint16_t>().swap(targetRule);
     }
+    return listed;
   }
 
   // --- Helpers ---
 
-  bool isExcludedFast(const char *path) const {
-    char value[1024];
-    ssize_t len =
-        getxattr(path, "com.apple.metadata:com_apple_backup_excludeItem", value,
-                 sizeof(value), 0, 0);
-    return (len > 0);
+  // pathExists() that remembers misses; a repeated miss costs no syscall.
+  // Must run on the shard's queue.
+  static bool probeExists(EventShard &shard, const std::string &path) {
+    if (shard.missing.contains(path)) {
+      ++shard.probesSaved;
+      return false;
+    }
+    if (pathExists(shard.dirFds, path))
+      return true;
+    shard.missing.insert(path);
+    return false;
   }
 
-  bool isParentExcluded(const fs::path &path) const {
-    fs::path current = path;
-    // Walk up the tree
-    while (current.has_relative_path()) {
-      if (isExcludedFast(current.c_str())) {
-        return true;
+  // Relative to the open parent directory, which a target and its
+  // sentinels share
+  static bool pathExists(DirFdCache &fds, const std::string &path) {
+    size_t slash = path.rfind('/');
+    int dirFd = -1;
+    if (slash != std::string::npos && slash > 0)
+      dirFd = fds.open(std::string_view(path).substr(0, slash));
+    ++t_probes;
+    if (dirFd < 0)
+      return access(path.c_str(), F_OK) == 0;
+    return faccessat(dirFd, path.c_str() + slash + 1, F_OK, 0) == 0;
+  }
+
+  static void buildSibling(std::string &out, std::string_view parent,
+                           std::string_view name) {
+    out.assign(parent.data(), parent.size());
+    out += '/';
+    out.append(name.data(), name.size());
+  }
+
+  // Flags every directory entry that is a rule target with its sentinel in
+  // the same listing: targetRule holds the index of the first matching rule
+  // plus one, or 0.
+  void matchTargets(const std::vector<DirEntry> &entries,
+                    std::vector<uint16_t> &targetRule) const {
+    // Which rules have their sentinel in this directory
+    // One table for the whole listing, even if a reload swaps it meanwhile
+    const ConfigRuleTable &table = config().table();
+    thread_local std::vector<char> sentinelPresent;
+    sentinelPresent.assign(table.ruleCount(), 0);
+    for (const auto &entry : entries) {
+      if (const RuleName *ruleName = table.find(entry.name)) {
+        for (uint8_t i = 0; i < ruleName->refCount; ++i) {
+          if (ruleName->refs[i].isSentinel)
+            sentinelPresent[ruleName->refs[i].index] = 1;
+        }
+      }
+    }
+
+    targetRule.assign(entries.size(), 0);
+    for (size_t e = 0; e < entries.size(); ++e) {
+      if (entries[e].type != EntryType::Directory)
+        continue;
+      if (const RuleName *ruleName = table.find(entries[e].name)) {
+        for (uint8_t i = 0; i < ruleName->refCount && !targetRule[e]; ++i) {
+          const RuleRef &ref = ruleName->refs[i];
+          if (!ref.isSentinel && sentinelPresent[ref.index])
+            targetRule[e] = uint16_t(ref.index + 1);
+        }
       }
-      if (current == m_watchRoot)
-        break; // Optimization: Don't check above watch root
-      current = current.parent_path();
     }
-    return false;
   }
 
-  bool shouldIgnore(const fs::path &path) const {
-    std::string pathStr = path.string();
+  bool isPrunedName(std::string_view name) const {
+    return config().isPrunedName(name);
+  }
 
-    // Ensure pathStr has a trailing separator for prefix matching if it's a
-    // directory However, since we don't always know if 'path' is a dir, we can
-    // match:
-    // 1. Exact match (without trailing slash)
-    // 2. Prefix match (with trailing slash in the ignore rule)
+  // Probes the filesystem unless the index knows; callers check m_paths for
+  // a cached answer first.
+  bool isParentExcluded(DirFdCache &fds, std::string_view path) {
+    ScopedLatency timer(m_metrics.parentExcluded);
+    ++m_metrics.parentExcludedCalls;
+    uint64_t probesBefore = t_probes;
+    bool excluded = findExcludedAncestor(fds, path);
+    m_metrics.parentExcludedProbes += t_probes - probesBefore;
+    return excluded;
+  }
 
-    // To match consistently, let's append a separator to pathStr for the
-    // comparison
-    std::string pathStrWithSep = pathStr;
-    if (pathStrWithSep.back() != fs::path::preferred_separator) {
-      pathStrWithSep += fs::path::preferred_separator;
+  // Walks down from the watch root (optimization: nothing above it is
+  // checked), so each directory is opened relative to its parent and the
+  // cache usually has the upper part of the path open already. The
+  // topmost excluded directory found is remembered, which covers the most.
+  bool findExcludedAncestor(DirFdCache &fds, std::string_view path) {
+    if (size_t length = m_index.covering(path)) {
+      m_paths.markExcluded(path.substr(0, length));
+      return true;
     }
 
-    for (const auto &ignorePrefix : m_absoluteIgnorePrefixes) {
-      // ignorePrefix already has a trailing separator.
-      // So we check if pathStrWithSep starts with ignorePrefix.
-      if (pathStrWithSep.rfind(ignorePrefix, 0) == 0) {
+    const WatchRoot *root = rootFor(path);
+    size_t length = root ? root->path.native().size() : path.find('/', 1);
+    thread_local std::string current; // only for the path-based fallback
+    for (;;) {
+      length = std::min(length, path.size());
+      std::string_view dir = path.substr(0, length);
+      int fd = fds.open(dir);
+      bool excluded;
+      if (fd >= 0) {
+        excluded = isExcludedFd(fd);
+      } else {
+        current.assign(dir.data(), dir.size()); // a file, or not readable
+        excluded = isExcludedFast(current.c_str());
+      }
+      if (excluded) {
+        rememberExcluded(dir);
         return true;
       }
+      if (length == path.size())
+        break;
+      length = path.find('/', length + 1);
     }
     return false;
   }
 
-  void applyExclusion(const fs::path &path) {
-    std::string pathStr = path.string();
+  void rememberExcluded(std::string_view dir) {
+    m_paths.markExcluded(dir);
+    m_index.add(dir);
+  }
 
-    // 1. Create .metadata_never_index to prevent Spotlight indexing
-    fs::path spotlightParamPath = path / ".metadata_never_index";
-    if (!fs::exists(spotlightParamPath)) {
-      std::ofstream outfile(spotlightParamPath);
-      if (outfile.good()) {
-        outfile.close();
-        std::cout << "DEBUG: Created .metadata_never_index in " << pathStr
-                  << std::endl;
-      } else {
-        std::cerr << "WARN: Failed to create .metadata_never_index in "
-                  << pathStr << std::endl;
-      }
-    }
+  // dir was removed or renamed, taking its exclusions with it
+  void forgetExcluded(std::string_view dir) {
+    m_paths.invalidate(dir);
+    m_index.invalidate(dir);
+  }
 
-    if (isExcludedFast(pathStr.c_str()))
-      return;
+  bool shouldIgnore(const fs::path &path) const {
+    return (m_paths.classify(path.native()) &
+            (PathTrie::kIgnored | PathTrie::kSkippedVolume)) ||
+           ignoredByGlob(path.native());
+  }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-      // Child process
-      execl("/usr/bin/tmutil", "tmutil", "addexclusion", pathStr.c_str(),
-            (char *)NULL);
+  bool ignoredByGlob(std::string_view path) const {
+    const WatchRoot *root = rootFor(path);
+    if (!root || path.size() <= root->prefix.size())
+      return false;
+    return config().ignoredByGlob(path.substr(root->prefix.size()));
+  }
 
-      // SAFETY: Use _exit in child to avoid flushing parent buffers or calling
-      // dtors
-      _exit(1);
-    } else {
-      int status;
-      waitpid(pid, &status, 0);
-      if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-        std::cout << "✅ Excluded: " << pathStr << std::endl;
-      } else {
-        std::cerr << "❌ Failed to exclude: " << pathStr << std::endl;
+  // Never blocks: the actual work happens on the exclusion queue.
+  void applyExclusion(std::string_view path, const EventTrace &trace = {}) {
+    if (trace)
+      m_metrics.eventToQueue.record(std::chrono::steady_clock::now() -
+                                    trace.arrived);
+    m_paths.markExcluding(path);
+    m_exclusions.enqueue(path, trace);
+  }
+
+  void recordAuditTarget(const std::string &target, uint16_t rule) {
+    std::lock_guard<std::mutex> guard(m_auditLock);
+    m_auditTargets.emplace_back(target, rule);
+  }
+};
+
+// --bench: generates a tree of projects in a temporary directory, runs the
+// scanner and synthetic event storms against it with exclusions stubbed
+// out, then removes the tree again.
+static int runBenchmark(Options options) {
+  char tmpl[] = "/tmp/asimov-bench.XXXXXX";
+  if (!mkdtemp(tmpl)) {
+    LOG_ERROR("Failed to create benchmark directory");
+    return 1;
+  }
+  fs::path root(tmpl);
+  options.benchProjects =
+      std::max<unsigned>(options.benchProjects, kBenchKinds);
+  std::cout << "Generating " << options.benchProjects << " projects in "
+            << root.string() << "..." << std::endl;
+  std::vector<fs::path> projects =
+      generateBenchTree(root, options.benchProjects, options.benchFiles);
+
+  options.roots = {{root.string(), {}}};
+  options.backend = "none";
+  options.maxLatency = 0; // There's no stream to restart
+
+  // Never destroyed: debounce timers may still reference it
+  AsimovWatcher *watcher = new AsimovWatcher(options);
+  watcher->benchmark(projects, options.benchEvents);
+
+  std::error_code ec;
+  fs::remove_all(root, ec);
+  return 0;
+}
+
+// --dry-run --report: one scan of the roots that changes nothing, then a
+// report of what the rules would exclude and how fast the scan ran.
+static int runReport(Options options) {
+  options.maxLatency = 0; // There's no stream to restart
+
+  // Never destroyed, like in runBenchmark()
+  AsimovWatcher *watcher = new AsimovWatcher(options);
+  watcher->report();
+  return 0;
+}
+
+static void printUsage(const char *argv0) {
+  std::cerr
+      << "Usage: " << argv0
+      << " [options] <directory_to_watch> [ignore_dirs...]\n"
+         "        [--root <directory_to_watch> [ignore_dirs...]]...\n"
+         "       " << argv0
+      << " --dry-run --report [options] <directory_to_watch>...\n"
+         "       " << argv0 << " --bench [bench options]\n"
+         "Options:\n"
+         "  --scan-threads N          Initial scan workers (default: cores)\n"
+         "  --prune NAME              Never scan into directories named NAME\n"
+         "  --config PATH             Rules file, reloaded on SIGHUP\n"
+         "  --scan-qos default|utility|background  Scan scheduling "
+         "(default: utility)\n"
+         "  --scan-rate N             Scan at most N entries/s\n"
+         "  --scan-memory MB          Cap on queued scan work (default: 64)\n"
+         "  --pause-on-battery        Hold scans while on battery\n"
+         "  --pause-on-thermal        Hold scans under thermal pressure\n"
+         "  --volumes all|local|root  Volumes below the roots to walk into "
+         "(default: local)\n"
+         "  --device-streams          One stream per volume for roots off "
+         "the boot volume\n"
+         "  --backend native|tmutil|none  How exclusions are applied\n"
+         "  --dry-run                 Same as --backend none\n"
+         "  --report                  With --dry-run: scan once, report what "
+         "would be\n"
+         "                            excluded, and exit\n"
+         "  --debounce MS             Event coalescing window (default: 250)\n"
+         "  --dir-events              Watch directory-level events\n"
+         "  --no-defer                Deliver the first event of a burst "
+         "immediately\n"
+         "  --latency S               FSEvents latency (default: 1.0)\n"
+         "  --max-latency S           Raise latency up to S during storms\n"
+         "  --event-shards N          Parallel event queues (default: cores)\n"
+         "  --metrics-socket PATH     Serve metrics JSON on a Unix socket\n"
+         "  --signposts               Trace exclusions for Instruments\n"
+         "  --log-level LEVEL         debug|info|warn|error (default: debug)\n"
+         "  --log-file PATH           Log to PATH instead of stdout/stderr\n"
+         "  --log-max-size MB         Rotate --log-file at MB (default: 10)\n"
+         "Bench options:\n"
+         "  --bench-projects N        Projects in the generated tree "
+         "(default: 200)\n"
+         "  --bench-files N           Files per directory (default: 20)\n"
+         "  --bench-events N          Events per storm (default: 100000)"
+      << std::endl;
+}
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--scan-threads" && i + 1 < argc) {
+      options.scanThreads =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--debounce" && i + 1 < argc) {
+      options.debounceMs =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--dir-events") {
+      options.dirEvents = true;
+    } else if (arg == "--no-defer") {
+      options.noDefer = true;
+    } else if (arg == "--latency" && i + 1 < argc) {
+      options.latency = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--max-latency" && i + 1 < argc) {
+      options.maxLatency = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--bench") {
+      options.bench = true;
+    } else if (arg == "--dry-run") {
+      options.dryRun = true;
+    } else if (arg == "--report") {
+      options.report = true;
+    } else if (arg == "--bench-projects" && i + 1 < argc) {
+      options.benchProjects =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--bench-files" && i + 1 < argc) {
+      options.benchFiles =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--bench-events" && i + 1 < argc) {
+      options.benchEvents =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--root" && i + 1 < argc) {
+      options.roots.push_back({argv[++i], {}});
+    } else if (arg == "--config" && i + 1 < argc) {
+      options.configPath = argv[++i];
+    } else if (arg == "--metrics-socket" && i + 1 < argc) {
+      options.metricsSocket = argv[++i];
+    } else if (arg == "--scan-qos" && i + 1 < argc) {
+      options.scanQos = argv[++i];
+      ScanThrottle::QoS qos;
+      if (!ScanThrottle::parseQoS(options.scanQos, qos)) {
+        std::cerr << "Unknown scan QoS: " << options.scanQos << std::endl;
+        return false;
+      }
+    } else if (arg == "--scan-rate" && i + 1 < argc) {
+      options.scanRate =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--scan-memory" && i + 1 < argc) {
+      options.scanMemoryMb =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--pause-on-battery") {
+      options.pauseOnBattery = true;
+    } else if (arg == "--pause-on-thermal") {
+      options.pauseOnThermal = true;
+    } else if (arg == "--volumes" && i + 1 < argc) {
+      options.volumes = argv[++i];
+      VolumePolicy policy;
+      if (!parseVolumePolicy(options.volumes, policy)) {
+        std::cerr << "Unknown volume policy: " << options.volumes
+                  << std::endl;
+        return false;
+      }
+    } else if (arg == "--device-streams") {
+      options.deviceStreams = true;
+    } else if (arg == "--signposts") {
+      options.signposts = true;
+    } else if (arg == "--log-level" && i + 1 < argc) {
+      options.logLevel = argv[++i];
+      LogLevel level;
+      if (!parseLogLevel(options.logLevel, level)) {
+        std::cerr << "Unknown log level: " << options.logLevel << std::endl;
+        return false;
+      }
+    } else if (arg == "--log-file" && i + 1 < argc) {
+      options.logFile = argv[++i];
+    } else if (arg == "--log-max-size" && i + 1 < argc) {
+      options.logMaxSizeMb =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--event-shards" && i + 1 < argc) {
+      options.eventShards =
+          static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--prune" && i + 1 < argc) {
+      options.pruneNames.push_back(argv[++i]);
+    } else if (arg == "--backend" && i + 1 < argc) {
+      options.backend = argv[++i];
+      if (!makeExclusionBackend(options.backend)) {
+        std::cerr << "Unknown exclusion backend: " << options.backend
+                  << std::endl;
+        return false;
       }
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    } else if (options.roots.empty()) {
+      options.roots.push_back({arg, {}});
+    } else {
+      // Default params strictly via arguments now (controlled by plist
+      // usually). Ignores belong to the root named before them.
+      options.roots.back().ignores.push_back(arg);
     }
   }
-};
+
+  if (options.report && !options.dryRun) {
+    std::cerr << "--report needs --dry-run" << std::endl;
+    return false;
+  }
+  if (options.dryRun)
+    options.backend = "none";
+  return options.bench || !options.roots.empty();
+}
 
 int main(int argc, char *argv[]) {
   // Faster I/O
   std::ios_base::sync_with_stdio(false);
   std::cin.tie(NULL);
 
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0]
-              << " <directory_to_watch> [ignore_dirs...]" << std::endl;
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage(argv[0]);
     return 1;
   }
 
-  std::string watchPath = argv[1];
-  std::vector<std::string> ignoredDirs;
+  LogLevel level = LogLevel::Debug;
+  parseLogLevel(options.logLevel, level);
+  logger().setLevel(level);
+  logger().start(options.logFile, uint64_t(options.logMaxSizeMb) << 20);
 
-  // Default params strictly via arguments now (controlled by plist usually)
-  if (argc > 2) {
-    for (int i = 2; i < argc; ++i) {
-      ignoredDirs.push_back(argv[i]);
-    }
-  }
+  if (options.bench)
+    return runBenchmark(options);
+  if (options.report)
+    return runReport(options);
 
-  AsimovWatcher watcher(watchPath, ignoredDirs);
+  AsimovWatcher watcher(options);
   watcher.run();
 
   return 0;